@@ -1,6 +1,12 @@
 
 #include "fs.h"
 
+// PROJECT: The workers share the block cache.  bc_lock guards the
+// readahead state, the ring, the dirty list and the blocks being read.
+// Faults on the disk map take it, so nothing may touch a block that is
+// not cached while holding it.
+static struct Lock bc_lock;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -24,6 +30,199 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// PROJECT: Sequential readahead.
+// file_read reports every block it reads through bc_readahead.  When a
+// file is read block after block, the next fault on it reads a window
+// of the file's following blocks as well, in one IDE command, as far
+// as they lie right after each other on disk.  The window doubles on
+// every sequential read up to RA_MAX blocks, which is the most a
+// single ide_read can move (256 sectors).
+#define NSTREAM		8
+#define RA_MIN		4
+#define RA_MAX		(256 / BLKSECTS)
+
+static struct Stream {
+	struct File *s_file;
+	uint32_t s_next;	// the block we expect to be read next
+	uint32_t s_window;	// blocks to read ahead, 0 if not sequential
+} streams[NSTREAM];
+static int stream_victim;
+
+// Window of the next fault, which must be on block ra_blockno.
+static uint32_t ra_blockno;
+static uint32_t ra_nblocks;
+
+// Note that block filebno of f, cached at addr, is about to be read.
+// The hint is only good for the next fault on that block; another
+// worker reading another file may replace it first.
+void
+bc_readahead(struct File *f, uint32_t filebno, void *addr)
+{
+	struct Stream *s;
+	uint32_t left, window, n;
+	int i;
+
+	lock_acquire(&bc_lock);
+	for (i = 0; i < NSTREAM; i++)
+		if (streams[i].s_file == f)
+			break;
+	if (i == NSTREAM) {
+		i = stream_victim;
+		stream_victim = (stream_victim + 1) % NSTREAM;
+		streams[i].s_file = f;
+		streams[i].s_next = ~0;
+	}
+	s = &streams[i];
+
+	if (filebno == s->s_next)
+		s->s_window = s->s_window ? MIN(2 * s->s_window, RA_MAX) : RA_MIN;
+	else if (filebno != s->s_next - 1)	// rereading the last block is fine
+		s->s_window = 0;
+	s->s_next = filebno + 1;
+	window = s->s_window;
+	lock_release(&bc_lock);
+
+	if (window == 0 || va_is_mapped(addr))
+		return;
+
+	// Fragmented files and versions whose blocks were copied on
+	// write are not contiguous; read ahead only what is.
+	left = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE - filebno;
+	n = file_block_run(f, filebno, MIN(window, left));
+
+	lock_acquire(&bc_lock);
+	ra_blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	ra_nblocks = n;
+	lock_release(&bc_lock);
+}
+
+// PROJECT: Cache replacement.
+// At most 'budget' blocks are kept in memory.  The cached blocks sit in
+// a ring that a clock hand walks when room is needed: a block whose
+// PTE_A bit is set gets a second chance (the bit is cleared), the
+// first block found without it is unmapped and written out if dirty.  The super block, bitmap and
+// reference count blocks are pinned; they are never in the ring.
+#define BC_MAXBLOCKS	16384
+
+static uint32_t ring[BC_MAXBLOCKS];	// the cached, unpinned blocks
+static uint32_t nring;
+static uint32_t hand;
+static uint32_t budget;
+
+static bool
+bc_pinned(uint32_t blockno)
+{
+	uint32_t nbitblocks, nrefblocks;
+
+	if (!super)
+		return true;
+	nbitblocks = (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	nrefblocks = (super->s_nblocks + NREFPERBLK - 1) / NREFPERBLK;
+	return blockno < 2 + nbitblocks
+		|| (super->s_refmap && blockno >= super->s_refmap
+		    && blockno < super->s_refmap + nrefblocks);
+}
+
+// PROJECT: Unmap the cached block at addr, writing it out if it is
+// dirty.  Other workers may be writing to it, so it is unmapped before
+// we look at PTE_D; it is written from EVICTVA.
+static void
+bc_drop(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int r;
+
+	if (!va_is_mapped(addr))
+		return;
+	if ((r = sys_page_map(0, addr, 0, (void *) EVICTVA, PTE_P | PTE_U)) < 0)
+		panic("bc_drop: sys_page_map return %e", r);
+	if (sys_page_clear(addr, PTE_P) & PTE_D) {
+		fs_counters.st_flushes++;
+		if ((r = ide_write_async(blockno * BLKSECTS, (void *) EVICTVA, BLKSECTS)) < 0)
+			panic("bc_drop: ide_write_async return %e", r);
+	}
+	sys_page_unmap(0, (void *) EVICTVA);
+}
+
+// Advance the clock hand to a block that has not been used since the
+// hand last passed it, evict it and return its ring slot.
+static uint32_t
+bc_evict(void)
+{
+	uint32_t slot;
+	void *addr;
+
+	for (;; hand = (hand + 1) % nring) {
+		addr = diskaddr(ring[hand]);
+		if (!va_is_mapped(addr))
+			break;
+		if (!(uvpt[PGNUM(addr)] & PTE_A))
+			break;
+
+		// PROJECT: sys_page_clear leaves PTE_D alone, so the
+		// block need not be written yet.
+		sys_page_clear(addr, PTE_A);
+	}
+
+	bc_drop(addr);
+	fs_counters.st_evictions++;
+
+	slot = hand;
+	hand = (hand + 1) % nring;
+	return slot;
+}
+
+// Note that blockno was just read into the cache.
+static void
+bc_insert(uint32_t blockno)
+{
+	if (bc_pinned(blockno))
+		return;
+	// The block was mapped with neither PTE_A nor PTE_D.  Touch the
+	// block so it counts as used, or the hand could pick it (or a
+	// block read ahead with it) while making room for the next one.
+	*(volatile char *) diskaddr(blockno);
+	if (nring < budget)
+		ring[nring++] = blockno;
+	else
+		ring[bc_evict()] = blockno;
+}
+
+// Keep at most nblocks unpinned blocks in memory, evicting blocks if
+// there are more than that cached now.
+void
+bc_set_budget(uint32_t nblocks)
+{
+	nblocks = MAX(MIN(nblocks, BC_MAXBLOCKS), 1);
+	lock_acquire(&bc_lock);
+	while (nring > nblocks) {
+		ring[bc_evict()] = ring[nring - 1];
+		nring--;
+		hand %= nring;
+	}
+	budget = nblocks;
+	lock_release(&bc_lock);
+}
+
+// PROJECT: Blocks a worker is reading from disk, n == 0 if none.
+static struct Reading {
+	uint32_t r_blockno;
+	uint32_t r_n;
+} reading[NWORKERS];
+
+// Is one of the n blocks from blockno on being read?
+static bool
+bc_reading(uint32_t blockno, uint32_t n)
+{
+	int i;
+
+	for (i = 0; i < NWORKERS; i++)
+		if (reading[i].r_n && reading[i].r_blockno < blockno + n
+		    && blockno < reading[i].r_blockno + reading[i].r_n)
+			return true;
+	return false;
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -31,6 +230,8 @@ bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	uint32_t i, n;	// PROJECT
+	struct Reading *rd;	// PROJECT
 	int r;
 
 	// Check that the fault was within the block cache region
@@ -49,28 +250,88 @@ bc_pgfault(struct UTrapframe *utf)
 	//
 	// LAB 5: you code here:
 	addr = ROUNDDOWN(addr, PGSIZE);
-	
-	if((r = sys_page_alloc(0, addr, PTE_P | PTE_W | PTE_U)) < 0)
-		panic("bc_pgfault: sys_page_alloc return %e\n", r);
 
-	if((r = ide_read(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
-		panic("bc_pgfault: ide_read return %e\n", r);
+	// PROJECT: Another worker may have read the block in since we
+	// faulted, or be reading it.  Either way, retry the access.
+	lock_acquire(&bc_lock);
+	if (va_is_mapped(addr) || bc_reading(blockno, 1)) {
+		lock_release(&bc_lock);
+		if (!va_is_mapped(addr))
+			sys_yield();
+		return;
+	}
 
+	// PROJECT: If file_read asked for readahead on this block, also
+	// read the file's blocks after it, up to the first one that is
+	// already cached, being read or free, with the same disk command.
+	n = 1;
+	if (blockno == ra_blockno) {
+		while (n < ra_nblocks && blockno + n < super->s_nblocks
+		       && !va_is_mapped(diskaddr(blockno + n))
+		       && !bc_reading(blockno + n, 1)
+		       && !(bitmap && block_is_free(blockno + n)))
+			n++;
+		ra_blockno = 0;
+	}
+	for (rd = reading; rd->r_n; rd++)
+		;
+	rd->r_blockno = blockno;
+	rd->r_n = n;
+	lock_release(&bc_lock);
+
+	// PROJECT: Read into this worker's READVA and move the pages to
+	// the disk map when they are whole.  The new mappings have
+	// neither PTE_A nor PTE_D set.
+	for (i = 0; i < n; i++)
+		if((r = sys_page_alloc(0, (void *) (READVA + i * BLKSIZE), PTE_P | PTE_W | PTE_U)) < 0)
+			panic("bc_pgfault: sys_page_alloc return %e\n", r);
+
+	if((r = ide_read(blockno * BLKSECTS, (void *) READVA, n * BLKSECTS)) < 0)
+		panic("bc_pgfault: ide_read return %e\n", r);
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %e", r);
+	for (i = 0; i < n; i++) {
+		if ((r = sys_page_map(0, (void *) (READVA + i * BLKSIZE), 0, addr + i * BLKSIZE, PTE_P | PTE_W | PTE_U)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		sys_page_unmap(0, (void *) (READVA + i * BLKSIZE));
+	}
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
 	// in?)
 	if (bitmap && block_is_free(blockno))
 		panic("reading free block %08x\n", blockno);
+
+	lock_acquire(&bc_lock);	// PROJECT
+	rd->r_n = 0;
+	fs_counters.st_faults++;		// PROJECT
+	fs_counters.st_readahead += n - 1;	// PROJECT
+
+	// PROJECT: Make room for the blocks under the budget.
+	for (i = 0; i < n; i++)
+		bc_insert(blockno + i);
+	lock_release(&bc_lock);
+}
+
+// PROJECT: flush_block with bc_lock held.  PTE_D is cleared before the
+// block is written, so whatever other workers write meanwhile marks it
+// dirty again rather than getting lost.
+static void
+bc_write(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int r;
+
+	if(!va_is_mapped(addr) || !va_is_dirty(addr)
+	   || !(sys_page_clear(addr, PTE_D) & PTE_D))
+		return;
+	fs_counters.st_flushes++;
+
+	if((r = ide_write_async(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
+		panic("flush_block: ide_write return %e\n", r);
 }
 
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
+// necessary, then clear the PTE_D bit using sys_page_clear.
 // If the block is not in the block cache or is not dirty, does
 // nothing.
 // Hint: Use va_is_mapped, va_is_dirty, and ide_write.
@@ -79,24 +340,118 @@ bc_pgfault(struct UTrapframe *utf)
 void
 flush_block(void *addr)
 {
-	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
-
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("flush_block of bad va %08x", addr);
 
 	// LAB 5: Your code here.
-	int r;
+	lock_acquire(&bc_lock);	// PROJECT
+	bc_write(ROUNDDOWN(addr, PGSIZE));
+	lock_release(&bc_lock);
+}
 
-	addr = ROUNDDOWN(addr, PGSIZE);
+// PROJECT: Dirty block list.
+// Blocks the file system functions may have written are listed here
+// with the file they belong to, so file_flush can write out just the
+// blocks of one file without walking all of them.  Versions share
+// blocks, so a block is listed once for every file that wrote it;
+// on_dirty has a bit per block that is on the list at all.
+#define NDIRTY	512
+
+static struct DirtyBlock {
+	uint32_t d_blockno;
+	struct File *d_owner;
+} dirty[NDIRTY];
+static int ndirty;
+static uint32_t on_dirty[DISKSIZE / BLKSIZE / 32];
+
+// Flush and drop the dirty list entries for which owner is 'owner',
+// or all of them if 'all' is set.
+static void
+dirty_drain(struct File *owner, bool all)
+{
+	int i, n;
+	uint32_t blockno;
 
-	if(!va_is_mapped(addr) || !va_is_dirty(addr))
-		return;
+	for (i = n = 0; i < ndirty; i++) {
+		if (!all && dirty[i].d_owner != owner) {
+			dirty[n++] = dirty[i];
+			continue;
+		}
+		blockno = dirty[i].d_blockno;
+		on_dirty[blockno / 32] &= ~(1 << (blockno % 32));
+		bc_write(diskaddr(blockno));
+	}
+	ndirty = n;
 
-	if((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
-		panic("flush_block: ide_write return %e\n", r);
+	// Blocks that other files listed too are still on the list.
+	for (i = 0; i < ndirty; i++) {
+		blockno = dirty[i].d_blockno;
+		on_dirty[blockno / 32] |= 1 << (blockno % 32);
+	}
+}
+
+// Put the block containing VA on the dirty list of file 'owner'.
+// Blocks that belong to no file, like the reference counts, are
+// listed with a NULL owner.
+// If the list is full it is flushed first.
+void
+bc_dirty(void *addr, struct File *owner)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int i;
+
+	lock_acquire(&bc_lock);	// PROJECT
+	// Only blocks already listed need a look at the list, newest
+	// entries first, since writes tend to repeat on the same block.
+	if (on_dirty[blockno / 32] & (1 << (blockno % 32)))
+		for (i = ndirty - 1; i >= 0; i--)
+			if (dirty[i].d_blockno == blockno && dirty[i].d_owner == owner)
+				goto out;
+	if (ndirty == NDIRTY)
+		dirty_drain(0, true);
+	on_dirty[blockno / 32] |= 1 << (blockno % 32);
+	dirty[ndirty].d_blockno = blockno;
+	dirty[ndirty].d_owner = owner;
+	ndirty++;
+out:
+	lock_release(&bc_lock);
+}
 
-	if((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("flush_block: sys_page_map return %e", r);
+// Write out the listed blocks of file 'owner', or the ones that belong
+// to no file if 'owner' is NULL.
+void
+bc_flush_file(struct File *owner)
+{
+	lock_acquire(&bc_lock);	// PROJECT
+	dirty_drain(owner, false);
+	lock_release(&bc_lock);
+}
+
+// Write out every dirty block in the cache and wait until it is on disk.
+// Blocks written without going through the dirty list are found by
+// their PTE_D bit; page tables of the disk map that are not present
+// are skipped whole, so only cached blocks are looked at.
+void
+bc_sync(void)
+{
+	uintptr_t va, end;
+
+	lock_acquire(&bc_lock);	// PROJECT
+	dirty_drain(0, true);
+	lock_release(&bc_lock);
+
+	end = DISKMAP + super->s_nblocks * BLKSIZE;
+	for (va = DISKMAP + BLKSIZE; va < end; va += BLKSIZE) {
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE - BLKSIZE;
+			continue;
+		}
+		if ((uvpt[PGNUM(va)] & (PTE_P|PTE_D)) == (PTE_P|PTE_D))
+			flush_block((void*) va);
+	}
+
+	// Blocks are written in the background; wait for them.
+	ide_drain();
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -134,6 +489,7 @@ bc_init(void)
 {
 	struct Super super;
 	set_pgfault_handler(bc_pgfault);
+	bc_set_budget(BC_BUDGET);	// PROJECT
 	check_bc();
 
 	// cache the super block by reading it once
@@ -141,80 +497,3 @@ bc_init(void)
 }
 
 
-#define DEBUG_GC	0
-
-/****** Challenge: ******/
-// This function is called from fs/serv.c:359
-//
-// The purpose of this function is to prevent an "out of memory" situation due to the cache, 
-// by clearing blocks from the cache if they have not been used for a long time.
-void
-garbage_collector(void)
-{
-	envid_t curenv_id = 0;
-	uint32_t blockno;
-	void* addr;
-	bool page_was_accessed;
-	int r;
-	uint32_t nbitblocks;
-
-#if DEBUG_GC
-	static uint8_t blkctr[1024] = {0};
-	static int call_ctr;
-	static int blocks_removed_ctr;
-	++call_ctr;
-#endif
-
-	// We want to make sure we don't unmap a bitmap block.
-	nbitblocks = (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
-
-	// Go through all the blocks, 
-	// if you find a block that has not been accessed since 
-	// the last time this function was called, 
-	// write it to disk (if necessary) and return the page to the free_list.
-	for(blockno = 2 + nbitblocks; blockno < super->s_nblocks; ++blockno){
-
-		// If the block is free, continue.
-		if(bitmap[blockno / 32] & (1 << (blockno % 32)))
-			continue;
-
-		addr = diskaddr(blockno);
-
-		// If the block is not yet mapped, continue.
-		if(!(uvpd[PDX(addr)] & PTE_P) || !(uvpt[PGNUM(addr)] & PTE_P))
-			continue;
-
-		page_was_accessed = uvpt[PGNUM(addr)] & PTE_A;
-
-		// Flush the contents of the block out to disk if necessary, 
-		// and clear the Dirty and Accessed bits using sys_page_map.
-		// So that next time we can check if it turns back on.
-		flush_block(addr);
-
-		if(!page_was_accessed)
-			continue;
-
-		// sys_page_unmap will call page_remove
-		if((r = sys_page_unmap(curenv_id, addr)) < 0)
-			panic("garbage_collector: sys_page_unmap return %e for addr %08x\n", r, addr);
-
-		// We do not mark the block as free because from the file system's perspective the block is still in use.	
-
-#if DEBUG_GC
-		++blkctr[blockno];
-		++blocks_removed_ctr;
-#endif
-	}
-
-#if DEBUG_GC
-	cprintf("DEBUG: GC called for the %d time and remove so far %d blocks\n", call_ctr, blocks_removed_ctr);
-
-	cprintf("GC statistic:\n");
-	for(blockno = 3; blockno < 1024; ++blockno){
-
-		if(blkctr[blockno] > 0)
-			cprintf("block %d removed %d times\n", blockno, blkctr[blockno]);
-	}
-#endif
-}
-
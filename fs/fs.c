@@ -1,5 +1,6 @@
 #include <inc/string.h>
 #include <inc/partition.h>
+#include <inc/x86.h>
 
 #include "fs.h"
 
@@ -36,6 +37,15 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
+// PROJECT: Free block summary, kept in memory only.
+// nfree[i] counts the free blocks described by bitmap block i, so the
+// allocator can skip full bitmap blocks without reading them.
+static uint32_t nfree[DISKSIZE / BLKSIZE / BLKBITSIZE];
+// Next-fit: allocation resumes where the previous one ended.
+static uint32_t alloc_hint;
+// Guards the bitmap, nfree and alloc_hint for the workers.
+static struct Lock bitmap_lock;
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -44,7 +54,100 @@ free_block(uint32_t blockno)
 	if (blockno == 0)
 		panic("attempt to free zero block");
 
+	lock_acquire(&bitmap_lock);	// PROJECT
 	bitmap[blockno / 32] |= (1 << (blockno % 32));
+	++nfree[blockno / BLKBITSIZE];	// PROJECT
+	lock_release(&bitmap_lock);	// PROJECT
+}
+
+// PROJECT: New function.
+// Return the first free block in [blockno, end), or end if there is none.
+// Skips full bitmap blocks using nfree and full words using bsf.
+static uint32_t
+bitmap_next_free(uint32_t blockno, uint32_t end)
+{
+	uint32_t bits;
+
+	while (blockno < end) {
+		if (nfree[blockno / BLKBITSIZE] == 0) {
+			blockno = ROUNDDOWN(blockno, BLKBITSIZE) + BLKBITSIZE;
+			continue;
+		}
+		bits = bitmap[blockno / 32] & (~0U << (blockno % 32));
+		if (bits == 0) {
+			blockno = ROUNDDOWN(blockno, 32) + 32;
+			continue;
+		}
+		return MIN(ROUNDDOWN(blockno, 32) + bsf(bits), end);
+	}
+	return end;
+}
+
+// PROJECT: New function.
+// Return the number of consecutive free blocks starting at blockno,
+// counting no further than n.
+static uint32_t
+bitmap_run(uint32_t blockno, uint32_t n)
+{
+	uint32_t len = 0;
+
+	while (len < n && blockno + len < super->s_nblocks) {
+		if ((blockno + len) % 32 == 0 && n - len >= 32
+		    && blockno + len + 32 <= super->s_nblocks
+		    && bitmap[(blockno + len) / 32] == ~0U)
+			len += 32;
+		else if (block_is_free(blockno + len))
+			++len;
+		else
+			break;
+	}
+	return len;
+}
+
+// PROJECT: New function.
+// Allocate n contiguous blocks, preferring the first run at or after
+// block 'goal' (0 means "wherever the last allocation ended").
+// The changed bitmap blocks are flushed to disk before returning.
+//
+// Return the first block number allocated on success,
+// -E_INVAL if n is 0,
+// -E_NO_DISK if there is no run of n free blocks.
+int
+alloc_blocks(uint32_t n, uint32_t goal)
+{
+	uint32_t start, end, len, pass, i;
+
+	if (n == 0)
+		return -E_INVAL;
+
+	lock_acquire(&bitmap_lock);
+	if (goal == 0 || goal >= super->s_nblocks)
+		goal = alloc_hint;
+
+	// Search [goal, s_nblocks) first, then wrap around to the beginning.
+	for (pass = 0; pass < 2; pass++) {
+		start = (pass == 0) ? goal : 0;
+		end = (pass == 0) ? super->s_nblocks : MIN(goal + n, super->s_nblocks);
+		while ((start = bitmap_next_free(start, end)) < end) {
+			if ((len = bitmap_run(start, n)) == n)
+				goto found;
+			start += len;
+		}
+	}
+	lock_release(&bitmap_lock);
+	return -E_NO_DISK;
+
+found:
+	for (i = start; i < start + n; i++) {
+		bitmap[i / 32] &= ~(1 << (i % 32));
+		--nfree[i / BLKBITSIZE];
+	}
+	for (i = ROUNDDOWN(start, BLKBITSIZE); i < start + n; i += BLKBITSIZE)
+		flush_block(&bitmap[i / 32]);
+
+	alloc_hint = start + n;
+	lock_release(&bitmap_lock);
+	return start;
 }
 
 // Search the bitmap for a free block and allocate it.  When you
@@ -63,21 +166,103 @@ alloc_block(void)
 	// super->s_nblocks blocks in the disk altogether.
 
 	// LAB 5: Your code here.
-	uint32_t blockno;
+	// PROJECT: a next-fit search over whole bitmap words.
+	return alloc_blocks(1, 0);
+}
+
+// PROJECT: New function.
+// Count the free blocks of every bitmap block into nfree.
+static void
+bitmap_init(void)
+{
+	uint32_t w, bits;
+
+	memset(nfree, 0, sizeof(nfree));
+	for (w = 0; w * 32 < super->s_nblocks; w++) {
+		bits = bitmap[w];
+		// Bits past the end of the disk are not blocks.
+		if (super->s_nblocks - w * 32 < 32)
+			bits &= (1 << (super->s_nblocks % 32)) - 1;
+		for (; bits != 0; bits &= bits - 1)
+			++nfree[w * 32 / BLKBITSIZE];
+	}
+}
 
-	for(blockno = 3; blockno < super->s_nblocks; ++blockno){
+// --------------------------------------------------------------
+// Block reference counts	// PROJECT
+// --------------------------------------------------------------
 
-		if(!block_is_free(blockno))
-			continue;
+// Versions open in different workers share blocks, so the counts
+// change under refmap_lock.
+static struct Lock refmap_lock;
 
-		bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+// The reference count of 'blockno' changed.  Its refmap block belongs
+// to no file; file_flush writes it out with the blocks of the file.
+static void
+refmap_dirty(uint32_t blockno)
+{
+	bc_dirty(&refmap[blockno], 0);
+}
 
-		flush_block(&bitmap[blockno / 32]);
-		
-		return blockno;
-	}		
+// Drop one reference to 'blockno' if other versions share it.
+// Returns false if the caller held the only one.
+static bool
+refmap_drop(uint32_t blockno)
+{
+	bool shared;
 
-	return -E_NO_DISK;
+	lock_acquire(&refmap_lock);
+	if ((shared = refmap && refmap[blockno] > 0)) {
+		--refmap[blockno];
+		refmap_dirty(blockno);
+	}
+	lock_release(&refmap_lock);
+	return shared;
+}
+
+// Record one more version sharing block 'blockno'.
+void
+block_ref(uint32_t blockno)
+{
+	if (refmap == 0 || blockno == 0)
+		return;
+	lock_acquire(&refmap_lock);
+	++refmap[blockno];
+	refmap_dirty(blockno);
+	lock_release(&refmap_lock);
+}
+
+// Drop one reference to block 'blockno', freeing it with the last one.
+// Without a reference count table the block is freed right away; the
+// callers then only drop blocks of files that have no versions.
+void
+block_unref(uint32_t blockno)
+{
+	if (!refmap_drop(blockno))
+		free_block(blockno);
+}
+
+// If block *pdiskbno is shared with other versions, point *pdiskbno at a
+// private copy of it instead.
+// Returns 0 on success, -E_NO_DISK if there is no space for the copy.
+static int
+block_unshare(uint32_t *pdiskbno)
+{
+	int r;
+
+	if (refmap == 0 || refmap[*pdiskbno] == 0)
+		return 0;
+	if ((r = alloc_block()) < 0)
+		return r;
+	memmove(diskaddr(r), diskaddr(*pdiskbno), BLKSIZE);
+	// The other versions may have let go of the block meanwhile,
+	// leaving it to us alone.
+	if (!refmap_drop(*pdiskbno)) {
+		free_block(r);
+		return 0;
+	}
+	*pdiskbno = r;
+	return 0;
 }
 
 // Validate the file system bitmap.
@@ -117,34 +302,50 @@ fs_init(void)
                ide_set_disk(1);
        else
                ide_set_disk(0);
+
+	// PROJECT: Transfer with bus-master DMA when the controller has it.
+	// Pass false to keep the disk on PIO.
+	if (ide_set_dma(true) < 0)
+		cprintf("PROJECT: no bus-master IDE controller, using PIO\n");
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
 
-	// Read last timestamp from disk and set track_ts as default to super->last_ts.
-	super->last_ts = super->last_ts;	// PROJECT
+	// PROJECT: The last timestamp is kept on disk.
 	cprintf("PROJECT: The last timestamp is %d\n", super->last_ts);		
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
+	bitmap_init();	// PROJECT
+
+	// PROJECT: Set "refmap" to the reference counts, if the disk has them.
+	if (super->s_refmap) {
+		refmap = diskaddr(super->s_refmap);
+		assert(!block_is_free(super->s_refmap));
+	}
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
 // The slot will be one of the f->f_direct[] entries,
 // or an entry in the indirect block.
+// PROJECT: or an entry in one of the indirect blocks listed in the
+// double-indirect block.
 // When 'alloc' is set, this function will allocate an indirect block
 // if necessary.
+// PROJECT: Without 'alloc' it allocates nothing and puts nothing on the
+// dirty list, so readers never touch blocks that versions share.
 //
 // Returns:
 //	0 on success (but note that *ppdiskbno might equal 0).
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range
+//		(it's >= NDIRECT + NINDIRECT + NDINDIRECT).
 //
 // Analogy: This is like pgdir_walk for files.
 // Hint: Don't forget to clear any block you allocate.
@@ -152,9 +353,10 @@ static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
        // LAB 5: Your code here.
-	uint32_t blockno;
+	int blockno;
+	uint32_t *dind;
 
-	if(!f || filebno >= NDIRECT + NINDIRECT || ppdiskbno == NULL)
+	if(!f || filebno >= NDIRECT + NINDIRECT + NDINDIRECT || ppdiskbno == NULL)
 		return -E_INVAL;
 
 	if(filebno < NDIRECT){
@@ -163,6 +365,47 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 
 		return 0;
 	}
+
+	// PROJECT: blocks past the indirect block go through the
+	// double-indirect block and one of the indirect blocks it lists.
+	if(filebno >= NDIRECT + NINDIRECT){
+
+		filebno -= NDIRECT + NINDIRECT;
+
+		if(f->f_dindirect == 0){
+
+			if(!alloc)
+				return -E_NOT_FOUND;
+
+			if((blockno = alloc_block()) < 0)
+				return -E_NO_DISK;
+
+			memset(diskaddr(blockno), 0, BLKSIZE);
+			f->f_dindirect = blockno;
+		}
+
+		dind = (uint32_t*)diskaddr(f->f_dindirect) + filebno / NINDIRECT;
+		if(*dind == 0){
+
+			if(!alloc)
+				return -E_NOT_FOUND;
+
+			if((blockno = alloc_block()) < 0)
+				return -E_NO_DISK;
+
+			memset(diskaddr(blockno), 0, BLKSIZE);
+			*dind = blockno;
+		}
+
+		*ppdiskbno = (uint32_t*)diskaddr(*dind) + filebno % NINDIRECT;
+
+		// The caller may set the pointer; file_flush only writes
+		// out f's top-level map blocks by itself.
+		if(alloc)
+			bc_dirty(diskaddr(*dind), f);
+
+		return 0;
+	}
 	
 	if(f->f_indirect == 0){
 
@@ -172,6 +415,8 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 		if((blockno = alloc_block()) < 0)
 			return -E_NO_DISK;
 
+		// PROJECT: freed blocks are reused, clear stale pointers.
+		memset(diskaddr(blockno), 0, BLKSIZE);
 		f->f_indirect = blockno;
 	}
 
@@ -180,6 +425,45 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 	return 0;
 }
 
+// PROJECT: What a hole in a file reads as.  Nothing writes it.
+char zero_block[BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+// PROJECT: New function.
+// Count a lookup of block cache page blk for FSREQ_STATS.
+static void
+count_lookup(char *blk)
+{
+	fs_counters.st_lookups++;
+	if (va_is_mapped(blk))
+		fs_counters.st_hits++;
+}
+
+// PROJECT: New function.
+// Set *blk to the address in memory where the filebno'th block of
+// file 'f' is mapped, for callers that only read the block.  Nothing
+// is allocated: a hole reads as zero_block.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if filebno is out of range.
+int
+file_get_block_ro(struct File *f, uint32_t filebno, char **blk)
+{
+	uint32_t *blockno;
+	int r;
+
+	r = file_block_walk(f, filebno, &blockno, false);
+	if (r == -E_NOT_FOUND || (r == 0 && *blockno == 0)) {
+		*blk = zero_block;
+		return 0;
+	}
+	if (r < 0)
+		return r;
+
+	*blk = (char*)diskaddr(*blockno);
+	count_lookup(*blk);
+	return 0;
+}
+
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
 //
@@ -188,6 +472,10 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 //	-E_INVAL if filebno is out of range.
 //
 // Hint: Use file_block_walk and alloc_block.
+//
+// PROJECT: The caller may write the block, so it goes on f's dirty
+// list for file_flush.  Blocks shared with other versions are not
+// copied; regular file data goes through file_get_block_w.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
@@ -207,7 +495,216 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 	}
 
 	*blk = (char*)diskaddr(*blockno);
-		
+	count_lookup(*blk);	// PROJECT
+	bc_dirty(*blk, f);	// PROJECT
+	return 0;
+}
+
+// PROJECT: New function.
+// Return how many of the n blocks of f from filebno on lie right after
+// block filebno on disk, counting filebno itself.  Nothing is allocated;
+// a hole ends the run.
+uint32_t
+file_block_run(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t i, first, *pdiskbno;
+
+	if (n == 0 || file_block_walk(f, filebno, &pdiskbno, 0) < 0
+	    || (first = *pdiskbno) == 0)
+		return 0;
+	for (i = 1; i < n; i++)
+		if (file_block_walk(f, filebno + i, &pdiskbno, 0) < 0
+		    || *pdiskbno != first + i)
+			break;
+	return i;
+}
+
+// PROJECT: New function.
+// If other versions share the indirect (or double-indirect) block
+// 'blockno', make a private copy of it.  The block pointers in the
+// copy are one more reference each.
+// Returns the block to use from now on, 'blockno' itself if it is not
+// shared, or < 0 on error.
+static int
+indirect_unshare(uint32_t blockno)
+{
+	int r;
+	uint32_t i, *ind;
+
+	if (refmap == 0 || refmap[blockno] == 0)
+		return blockno;
+	if ((r = alloc_block()) < 0)
+		return r;
+	ind = diskaddr(r);
+	memmove(ind, diskaddr(blockno), BLKSIZE);
+	for (i = 0; i < NINDIRECT; i++)
+		block_ref(ind[i]);
+	// As in block_unshare, the block may be ours alone by now.
+	if (!refmap_drop(blockno)) {
+		for (i = 0; i < NINDIRECT; i++)
+			if (ind[i])
+				refmap_drop(ind[i]);
+		free_block(r);
+		return blockno;
+	}
+	return r;
+}
+
+// PROJECT: New function.
+// Drop a reference to indirect block 'blockno', which is 'depth' levels
+// above the data blocks (2 for the double-indirect block).  With the
+// last one, the blocks it points to lose a reference too.
+static void
+indirect_unref(uint32_t blockno, int depth)
+{
+	uint32_t i, *ind;
+
+	if (refmap_drop(blockno))
+		return;
+	ind = diskaddr(blockno);
+	for (i = 0; i < NINDIRECT; i++) {
+		if (ind[i] == 0)
+			continue;
+		if (depth > 1)
+			indirect_unref(ind[i], depth - 1);
+		else
+			block_unref(ind[i]);
+	}
+	free_block(blockno);
+}
+
+// PROJECT: New function.
+// Like file_block_walk with alloc set, for callers that will change
+// *ppdiskbno.  Versions of a regular file share its indirect blocks
+// until one of them changes a pointer in one; that one gets a copy of
+// each indirect block on the way.
+// Directory versions share their blocks on purpose and never copy.
+static int
+file_block_walk_w(struct File *f, uint32_t filebno, uint32_t **ppdiskbno)
+{
+	int r;
+	uint32_t *dind;
+
+	if (filebno < NDIRECT || (f->f_type & FTYPE_DIR))
+		return file_block_walk(f, filebno, ppdiskbno, 1);
+
+	if (filebno < NDIRECT + NINDIRECT) {
+		if (f->f_indirect) {
+			if ((r = indirect_unshare(f->f_indirect)) < 0)
+				return r;
+			f->f_indirect = r;
+		}
+	} else if (f->f_dindirect) {
+		if ((r = indirect_unshare(f->f_dindirect)) < 0)
+			return r;
+		f->f_dindirect = r;
+		dind = (uint32_t*) diskaddr(f->f_dindirect)
+			+ (filebno - NDIRECT - NINDIRECT) / NINDIRECT;
+		if (*dind) {
+			if ((r = indirect_unshare(*dind)) < 0)
+				return r;
+			*dind = r;
+		}
+	}
+	return file_block_walk(f, filebno, ppdiskbno, 1);
+}
+
+// PROJECT: New function.
+// Like file_get_block, but the block is about to be written: a data
+// block that f shares with other versions is copied first.
+static int
+file_get_block_w(struct File *f, uint32_t filebno, char **blk)
+{
+	int r;
+	uint32_t *pdiskbno;
+
+	if (f->f_type & FTYPE_DIR)
+		return file_get_block(f, filebno, blk);
+
+	if ((r = file_block_walk_w(f, filebno, &pdiskbno)) < 0)
+		return r;
+	if (*pdiskbno == 0) {
+		if ((r = alloc_block()) < 0)
+			return -E_NO_DISK;
+		*pdiskbno = r;
+	} else if ((r = block_unshare(pdiskbno)) < 0)
+		return r;
+	*blk = diskaddr(*pdiskbno);
+	bc_dirty(*blk, f);
+	return 0;
+}
+
+// PROJECT: Directories get a hash index when they grow to this many
+// blocks.  Smaller ones are cheaper to scan.
+#define DIR_HTREE_MIN	2
+
+// PROJECT: New function.
+// FNV-1a hash of a file name.
+static uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
+// PROJECT: New function.
+// Return the i'th entry slot of dir, or NULL on error.
+// Callers that change the entry put its block on dir's dirty list.
+static struct File*
+dir_slot(struct File *dir, uint32_t i)
+{
+	char *blk;
+
+	if (file_get_block_ro(dir, i / BLKFILES, &blk) < 0)
+		return 0;
+	return (struct File*) blk + i % BLKFILES;
+}
+
+// PROJECT: New function.
+// Link entry 'slot' of dir, whose name is already set, into its bucket.
+static void
+dir_htree_insert(struct File *dir, struct File *f, uint32_t slot)
+{
+	uint32_t *heads = diskaddr(dir->f_htree);
+
+	f->f_hash = dir_hash(f->f_name);
+	f->f_hnext = heads[f->f_hash % NHASHBUCKETS];
+	heads[f->f_hash % NHASHBUCKETS] = slot + 1;
+}
+
+// PROJECT: New function.
+// Build the hash index of dir from its entries.  Only dir_alloc_file
+// calls this, on the latest version of a directory; lookups never
+// allocate.  On failure dir is left without an index.
+static int
+dir_htree_build(struct File *dir)
+{
+	int r;
+	uint32_t i, nslots;
+	struct File *f;
+
+	if ((r = alloc_block()) < 0)
+		return r;
+	dir->f_htree = r;
+	memset(diskaddr(dir->f_htree), 0, BLKSIZE);
+
+	nslots = dir->f_size / BLKSIZE * BLKFILES;
+	for (i = 0; i < nslots; i++) {
+		if ((f = dir_slot(dir, i)) == 0) {
+			// A partial index would hide the entries not in it.
+			free_block(dir->f_htree);
+			dir->f_htree = 0;
+			return -E_NO_DISK;
+		}
+		if (f->f_name[0] != '\0') {
+			dir_htree_insert(dir, f, i);
+			bc_dirty(f, dir);
+		}
+	}
+	file_flush(dir);
 	return 0;
 }
 
@@ -219,7 +716,7 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, h, slot;
 	char *blk;
 	struct File *f;
 
@@ -228,8 +725,29 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
+
+	// PROJECT: follow the name's hash bucket in indexed directories.
+	if (dir->f_htree != 0) {
+		h = dir_hash(name);
+		slot = ((uint32_t*) diskaddr(dir->f_htree))[h % NHASHBUCKETS];
+		for (; slot != 0; slot = f->f_hnext) {
+			// An older version of dir shares its index with newer
+			// ones that may have grown; fall back to the scan.
+			if (slot - 1 >= nblock * BLKFILES)
+				goto scan;
+			if ((f = dir_slot(dir, slot - 1)) == 0)
+				return -E_NO_DISK;
+			if (f->f_hash == h && strcmp(f->f_name, name) == 0) {
+				*file = f;
+				return 0;
+			}
+		}
+		return -E_NOT_FOUND;
+	}
+
+scan:
 	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+		if ((r = file_get_block_ro(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
@@ -241,73 +759,303 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
+// PROJECT: Dentry cache.  Remembers what dir_lookup found for a name in
+// a directory version, or that it found nothing.  Directory versions
+// share their blocks, so an entry never moves once allocated; only
+// ff_prune moves version records, and it empties the cache.  A new
+// entry can turn a cached miss into a hit in every version sharing the
+// block, so misses only count for the generation they were seen in.
+#define NDCACHE		256
+
+struct Dentry {
+	struct File *d_dir;	// directory version, NULL if unused
+	struct File *d_file;	// what dir_lookup found, NULL if nothing
+	uint32_t d_gen;		// dcache_gen when a miss was cached
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[NDCACHE];
+static uint32_t dcache_gen;
+// Walks run in several workers at once; a slot is read and filled
+// under dcache_lock.  dcache_gen only changes with fs_ns held
+// exclusively, when nobody walks.
+static struct Lock dcache_lock;
+
+// PROJECT: New function.
+// Return the cache slot of name in dir.
+static struct Dentry*
+dcache_slot(struct File *dir, const char *name)
+{
+	return &dcache[(dir_hash(name) ^ ((uint32_t) dir / sizeof(struct File))) % NDCACHE];
+}
+
+// PROJECT: New function.
+// Forget every cached lookup.
+static void
+dcache_flush(void)
+{
+	memset(dcache, 0, sizeof(dcache));
+}
+
+// PROJECT: New function.
+// dir_lookup through the dentry cache.
+static int
+dcache_lookup(struct File *dir, const char *name, struct File **file)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+	int r;
+
+	fs_counters.st_dlookups++;
+	lock_acquire(&dcache_lock);
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0
+	    && (d->d_file || d->d_gen == dcache_gen)) {
+		fs_counters.st_dhits++;
+		*file = d->d_file;
+		lock_release(&dcache_lock);
+		return *file ? 0 : -E_NOT_FOUND;
+	}
+	lock_release(&dcache_lock);
+
+	if ((r = dir_lookup(dir, name, file)) < 0 && r != -E_NOT_FOUND)
+		return r;
+	lock_acquire(&dcache_lock);
+	d->d_dir = dir;
+	d->d_file = (r == 0) ? *file : 0;
+	d->d_gen = dcache_gen;
+	strcpy(d->d_name, name);
+	lock_release(&dcache_lock);
+	return r;
+}
+
 // PROJECT: New function.
-// Return the file/dir from fatfile according to requested ts
+// Return the i'th version record of fatfile ff.
+// Callers that change the record put its block on ff's dirty list.
 static struct File*
-ff_lookup(struct File* ff)	// PROJECT
+ff_version(struct File *ff, uint32_t i)
 {
 	int r;
-	uint32_t i, j, nblock;
-	char* blk;
-	struct File *f, *ret_f;
+	char *blk;
 
-	if((ff->f_type & FTYPE_FF) == 0)
-		return ff;
+	if((r = file_get_block_ro(ff, i / BLKFILES, &blk)) < 0)
+		panic("ff_version: file_get_block_ro return %e for file %s slot %d\n", r, ff->f_name, i);
+
+	return (struct File*)blk + i % BLKFILES;
+}
+
+// PROJECT: New function.
+// Fat files made before the version index existed have f_nvers == 0.
+// Their records are dense (nothing was ever removed from a fatfile),
+// so count them once and remember the result.
+static void
+ff_count_versions(struct File *ff)
+{
+	uint32_t i, nslots;
+
+	nslots = ff->f_size / BLKSIZE * BLKFILES;
+	for(i = 0; i < nslots && ff_version(ff, i)->f_name[0] != '\0'; ++i)
+		;
+	ff->f_nvers = i;
+	flush_block(ff);
+}
 
-	ret_f = 0;
+// PROJECT: New function.
+// Return the number of versions of fatfile ff with f_timestamp <= ts.
+// They are the first records of ff, since records are sorted by timestamp.
+static uint32_t
+ff_upto(struct File *ff, ts_t ts)
+{
+	uint32_t lo, hi, mid;
 
 	// We maintain the invariant that the size of a fatfile
 	// is always a multiple of the file system's block size (like a directory-file).
 	assert((ff->f_size % BLKSIZE) == 0);
-	nblock = ff->f_size / BLKSIZE;
 
-	// TODO: Performance can be improved by replacing this loop with a binary search.
-	for(i = 0; i < nblock; ++i){
+	if(ff->f_nvers == 0 && ff->f_size > 0)
+		ff_count_versions(ff);
+
+	// Fast path: ff->f_timestamp is the timestamp of the latest version.
+	if(ts >= ff->f_timestamp)
+		return ff->f_nvers;
+
+	// Find the first record with f_timestamp > ts.
+	lo = 0;
+	hi = ff->f_nvers;
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(ff_version(ff, mid)->f_timestamp <= ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// PROJECT: New function.
+// Return the file/dir from fatfile according to requested ts,
+// i.e. the latest version with f_timestamp <= ts, or NULL.
+static struct File*
+ff_lookup(struct File* ff, ts_t ts)	// PROJECT
+{
+	uint32_t n;
+
+	if((ff->f_type & FTYPE_FF) == 0)
+		return ff;
 
-		if((r = file_get_block(ff, i, &blk)) < 0)
-			panic("ff_lookup: file_get_block return %d for file %s with track_ts %d\n", r, ff->f_name, track_ts);
+	n = ff_upto(ff, ts);
+	return (n == 0) ? 0 : ff_version(ff, n - 1);
+}
 
-		f = (struct File*)blk;
+// PROJECT: New function.
+// Store in vers[] the versions of fatfile ff with f_timestamp <= ts,
+// newest first, at most n of them.  Returns how many were stored.
+int
+ff_versions(struct File *ff, ts_t ts, struct File **vers, int n)
+{
+	uint32_t i;
+	int k;
 
-		for(j = 0; j < BLKFILES; ++j){
+	i = ff_upto(ff, ts);
+	for(k = 0; k < n && i > 0; ++k)
+		vers[k] = ff_version(ff, --i);
+	return k;
+}
 
-			if(f[j].f_name[0] == '\0')
-				continue;
+// PROJECT: New function.
+// Return the latest version of fatfile ff (ff itself if it is not a
+// fatfile), or NULL if it has none.
+struct File*
+ff_latest(struct File *ff)
+{
+	return ff_lookup(ff, super->last_ts);
+}
 
-			if(f[j].f_timestamp <= track_ts)
-				ret_f = &f[j];
-		}
-	}
-	return ret_f;
+// PROJECT: Fatfiles that got new versions since the last pruning pass.
+#define NPRUNEQ	64
+static struct File *prune_queue[NPRUNEQ];
+static int nprune;
+
+// PROJECT: New function.
+// Does rp ask to remove anything?
+static bool
+retention_active(const struct Retention *rp)
+{
+	return rp->r_keep_last > 0 || rp->r_keep_since != 0 || rp->r_thin;
+}
+
+// PROJECT: New function.
+// Remember that fatfile ff should be looked at by the next pruning pass.
+// If the queue is full ff is dropped; its next version will queue it again.
+static void
+prune_enqueue(struct File *ff)
+{
+	int i;
+
+	if (!retention_active(&retention))
+		return;
+	for (i = 0; i < nprune; i++)
+		if (prune_queue[i] == ff)
+			return;
+	if (nprune < NPRUNEQ)
+		prune_queue[nprune++] = ff;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// PROJECT: New function.
+// Set *file to a cleared record at the end of fatfile ff.
+// Unlike dir_alloc_file, never reuse a slot, so the records stay sorted.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+ff_alloc_version(struct File *ff, struct File **file)
 {
 	int r;
-	uint32_t nblock, i, j;
 	char *blk;
+
+	assert((ff->f_size % BLKSIZE) == 0);
+
+	if(ff->f_nvers == 0 && ff->f_size > 0)
+		ff_count_versions(ff);
+
+	if(ff->f_nvers == ff->f_size / BLKSIZE * BLKFILES){
+		if((r = file_get_block(ff, ff->f_size / BLKSIZE, &blk)) < 0)
+			return r;
+		ff->f_size += BLKSIZE;
+	}
+
+	*file = ff_version(ff, ff->f_nvers++);
+	memset(*file, 0, sizeof(struct File));
+	bc_dirty(*file, ff);
+	prune_enqueue(ff);
+	return 0;
+}
+
+// PROJECT: New function.
+// The number of bits in age, so ages 2^(k-1) .. 2^k - 1 share range k.
+// Thinning keeps one version of each range.
+static uint32_t
+age_range(ts_t age)
+{
+	uint32_t k;
+
+	for (k = 0; age > 0; age >>= 1)
+		k++;
+	return k;
+}
+
+// PROJECT: New function.
+// Should rp keep version i of fatfile ff?
+// Looks at versions i and i+1 only, which ff_prune has not moved yet.
+static bool
+ff_keep(struct File *ff, uint32_t i, const struct Retention *rp)
+{
+	ts_t ts;
+
+	if (i + 1 == ff->f_nvers)
+		return 1;
+	if (ff->f_nvers - 1 - i < rp->r_keep_last)
+		return 1;
+	ts = ff_version(ff, i)->f_timestamp;
+	if (rp->r_keep_since > 0 && ts >= rp->r_keep_since)
+		return 1;
+	if (rp->r_thin && age_range(ff->f_timestamp - ts)
+	    != age_range(ff->f_timestamp - ff_version(ff, i + 1)->f_timestamp))
+		return 1;
+	return 0;
+}
+
+// Set *file to point at a free File structure in dir and name it.
+// The caller is responsible for filling in the other File fields.
+// PROJECT: the search starts at dir->f_dfree rather than the first slot,
+// and the new entry is linked into the hash index if dir has one.  A
+// directory that grows to DIR_HTREE_MIN blocks gets its index here.
+static int
+dir_alloc_file(struct File *dir, const char *name, struct File **file)
+{
+	uint32_t nslots, i;
 	struct File *f;
+	int r;
 
 	assert((dir->f_size % BLKSIZE) == 0);
-	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
-			return r;
-		f = (struct File*) blk;
-		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0') {
-				*file = &f[j];
-				return 0;
-			}
+	nslots = dir->f_size / BLKSIZE * BLKFILES;
+	for (i = MIN(dir->f_dfree, nslots); i < nslots; i++) {
+		if ((f = dir_slot(dir, i)) == 0)
+			return -E_NO_DISK;
+		if (f->f_name[0] == '\0')
+			goto found;
 	}
+	if ((f = dir_slot(dir, i)) == 0)
+		return -E_NO_DISK;
+	memset(f, 0, BLKSIZE);
 	dir->f_size += BLKSIZE;
-	if ((r = file_get_block(dir, i, &blk)) < 0)
-		return r;
-	f = (struct File*) blk;
-	*file = &f[0];
+found:
+	memset(f, 0, sizeof(struct File));
+	strcpy(f->f_name, name);
+	bc_dirty(f, dir);
+	if (dir->f_htree != 0)
+		dir_htree_insert(dir, f, i);
+	else if (dir->f_size / BLKSIZE >= DIR_HTREE_MIN
+		 && (r = dir_htree_build(dir)) < 0)
+		cprintf("warning: dir_htree_build %s: %e\n", dir->f_name, r);
+	dcache_gen++;	// cached misses of name may be wrong now
+	dir->f_dfree = i + 1;
+	*file = f;
 	return 0;
 }
 
@@ -322,40 +1070,93 @@ skip_slash(const char *p)
 
 // copy blocks numbers form fromfile to a new file (dir/reg).
 // if fromfile is reg, last block will deep copy to support appending to it without page fault.
+// PROJECT: every block the new file shares with fromfile gets a reference.
+// With reference counts the partial last block is shared as well, and
+// file_write copies it only when a write lands in it.
 struct File* 
 file_shalldup(struct File *ff, struct File *fromfile)	// PROJECT
 {
 	int r;
-	uint32_t i, last_bn;
-	struct File *f, *newfile;
+	uint32_t i, last_bn, n;
+	uint32_t *ind, *dind, *pdiskbno;
+	struct File *newfile;
 	void *buf;
 	size_t count;
 	off_t offset;
 
-	if((r = dir_alloc_file(ff, &newfile)) < 0)
-		panic("PROJECT: file_shalldup: dir_alloc_file return %e\n", r);
+	if((r = ff_alloc_version(ff, &newfile)) < 0)
+		panic("PROJECT: file_shalldup: ff_alloc_version return %e\n", r);
 
 	strcpy(newfile->f_name, fromfile->f_name);
 	newfile->f_type = fromfile->f_type;
 	newfile->f_timestamp = super->last_ts;
 
-	if(fromfile->f_type & FTYPE_DIR)
+	// A directory's versions share its entry blocks, so they share the
+	// hash index over them as well.
+	newfile->f_htree = fromfile->f_htree;
+	newfile->f_dfree = fromfile->f_dfree;
+	block_ref(newfile->f_htree);
+
+	if(fromfile->f_type & FTYPE_DIR || refmap)
 		last_bn = (fromfile->f_size + BLKSIZE - 1) / BLKSIZE;
 	else
 		last_bn = fromfile->f_size / BLKSIZE;
 
-	for(i = 0; i < MIN(NDIRECT, last_bn); ++i)
+	for(i = 0; i < MIN(NDIRECT, last_bn); ++i){
 		newfile->f_direct[i] = fromfile->f_direct[i];	
+		block_ref(newfile->f_direct[i]);
+	}
+
+	if(refmap && fromfile->f_indirect){
 
-	if(last_bn >= NDIRECT){
+		// Share the indirect block as a whole, see file_block_walk_w.
+		newfile->f_indirect = fromfile->f_indirect;
+		block_ref(newfile->f_indirect);
+	}
+	else if(last_bn > NDIRECT){
 
-		if((newfile->f_indirect = alloc_block()) < 0);
+		if((r = alloc_block()) < 0)
 			panic("PROJECT: file_shalldup: we are out of blocks\n");
+		newfile->f_indirect = r;
+
+		// Without reference counts the new version gets its own copy,
+		// holding only whole blocks so the partial last block is not
+		// shared.
+		ind = diskaddr(newfile->f_indirect);
+		memset(ind, 0, BLKSIZE);
+		memmove(ind, diskaddr(fromfile->f_indirect), MIN(last_bn - NDIRECT, NINDIRECT) * sizeof(uint32_t));
+	}
+
+	if(refmap && fromfile->f_dindirect){
+
+		// Share the double-indirect block as a whole too.
+		newfile->f_dindirect = fromfile->f_dindirect;
+		block_ref(newfile->f_dindirect);
+	}
+	else if(last_bn > NDIRECT + NINDIRECT){
 
-		memmove(diskaddr(newfile->f_indirect), diskaddr(fromfile->f_indirect), BLKSIZE);
+		// Copy it and the indirect blocks it lists, again holding
+		// only whole blocks.
+		if((r = alloc_block()) < 0)
+			panic("PROJECT: file_shalldup: we are out of blocks\n");
+		newfile->f_dindirect = r;
+		dind = diskaddr(newfile->f_dindirect);
+		memset(dind, 0, BLKSIZE);
+
+		n = last_bn - NDIRECT - NINDIRECT;
+		for(i = 0; i * NINDIRECT < n; ++i){
+			if((r = alloc_block()) < 0)
+				panic("PROJECT: file_shalldup: we are out of blocks\n");
+			dind[i] = r;
+			ind = diskaddr(dind[i]);
+			memset(ind, 0, BLKSIZE);
+			memmove(ind, diskaddr(((uint32_t*)diskaddr(fromfile->f_dindirect))[i]),
+				MIN(n - i * NINDIRECT, NINDIRECT) * sizeof(uint32_t));
+			bc_dirty(ind, newfile);
+		}
 	}
 
-	if(fromfile->f_type & FTYPE_DIR || fromfile->f_size == last_bn * BLKSIZE){
+	if(fromfile->f_size <= last_bn * BLKSIZE){
 		newfile->f_size = fromfile->f_size;
 		return newfile;
 	}
@@ -363,10 +1164,9 @@ file_shalldup(struct File *ff, struct File *fromfile)	// PROJECT
 	newfile->f_size = last_bn * BLKSIZE;	// Only whole blocks
 
 	// deep copy for last block
-	if(last_bn < NDIRECT)
-		buf = diskaddr(fromfile->f_direct[last_bn]);
-	else
-		buf = diskaddr(((uint32_t*)diskaddr(fromfile->f_indirect))[last_bn - NDIRECT]);
+	if((r = file_block_walk(fromfile, last_bn, &pdiskbno, 0)) < 0)
+		panic("PROJECT: file_shalldup: file_block_walk return %e\n", r);
+	buf = diskaddr(*pdiskbno);
 	count = fromfile->f_size % BLKSIZE;
 	offset = last_bn * BLKSIZE;
 
@@ -385,16 +1185,20 @@ file_shalldup(struct File *ff, struct File *fromfile)	// PROJECT
 // If we cannot find the file but find the directory
 // it should be in, set *pdir and copy the final path
 // element into lastelem.
+// PROJECT: fatfiles on the way resolve to their version for w->w_ts,
+// and in WALK_CREATE mode get a new version if they lack one for the
+// last timestamp.  A relative path starts at directory 'at' instead,
+// if it is not NULL; 'at' may be a fatfile too.
 static int
-walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem, struct File** ff)
+walk_path(const struct Walk *w, struct File *at, const char *path, struct File **pdir, struct File **pf, char *lastelem, struct File** ff)
 {
 	const char *p;
 	char name[MAXNAMELEN];
 	struct File *dir, *f;
 	int r;
 
+	f = (at && path[0] != '/') ? at : &super->s_root;	// PROJECT
 	path = skip_slash(path);
-	f = &super->s_root;
 	dir = 0;
 	name[0] = 0;
 
@@ -418,15 +1222,16 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 
 			*ff = dir;
 
-			if(walk_mode == WALK_CREATE && dir->f_timestamp < super->last_ts){
+			if(w->w_mode == WALK_CREATE && dir->f_timestamp < super->last_ts){
 
-				if((dir = ff_lookup(dir)) == 0)
+				if((dir = ff_lookup(dir, w->w_ts)) == 0)
 					panic("PROJECT: walk_path: ff_lookup return NULL for dir.f_name=%s while super->last_ts=%d\n", (*ff)->f_name, super->last_ts);
 
 				dir = file_shalldup(*ff, dir);
 				(*ff)->f_timestamp = super->last_ts;
+				flush_block(*ff);
 			}
-			else if((dir = ff_lookup(dir)) == 0)
+			else if((dir = ff_lookup(dir, w->w_ts)) == 0)
 				panic("PROJECT: walk_path: ff_lookup return NULL for dir.f_name=%s while super->last_ts=%d\n", (*ff)->f_name, super->last_ts);
 		}
 
@@ -434,7 +1239,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dcache_lookup(dir, name, &f)) < 0) {	// PROJECT
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -454,7 +1259,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 
 		*ff = f;
 
-		if((*pf = ff_lookup(f)) == 0)
+		if((*pf = ff_lookup(f, w->w_ts)) == 0)
 			//printf("PROJECT: walk_path: ff_lookup return NULL for f.f_name=%s while super->last_ts=%d\n", f->f_name, super->last_ts);
 			return -E_NOT_FOUND;
 	}
@@ -472,6 +1277,17 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 // On error return < 0.
 int
 file_create(const char *path, struct File **pf)
+{
+	struct Walk w = { super->last_ts, WALK_CREATE };	// PROJECT
+
+	return file_create_at(&w, 0, path, pf);
+}
+
+// PROJECT: New function.
+// Like file_create, but walks the path as w says, and a relative path
+// starts at directory 'at'.  w->w_mode must be WALK_CREATE.
+int
+file_create_at(const struct Walk *w, struct File *at, const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
@@ -486,16 +1302,14 @@ file_create(const char *path, struct File **pf)
 
 	++super->last_ts;	// PROJECT
 
-	if ((r = walk_path(path, &dir, &f, name, &ff)) == 0)
+	if ((r = walk_path(w, at, path, &dir, &f, name, &ff)) == 0)
 		return -E_FILE_EXISTS;
 
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, name, &f)) < 0)
 		return r;
 
-	strcpy(f->f_name, name);
-
 	if(ff != 0){	// PROJECT
 
 		assert(dir->f_timestamp == super->last_ts);
@@ -506,12 +1320,11 @@ file_create(const char *path, struct File **pf)
 
 		// create first timestamp for f
 		dir = f;
-		if((r = dir_alloc_file(dir, &f)) < 0)
-			panic("PROJECT: create_ts: dir_alloc_file return %e\n", r);
+		if((r = ff_alloc_version(dir, &f)) < 0)
+			panic("PROJECT: create_ts: ff_alloc_version return %e\n", r);
 		strcpy(f->f_name, name);
 		f->f_type = f_type;
 		f->f_timestamp = super->last_ts;
-		track_ts = super->last_ts;
 	}
 	*pf = f;
 	file_flush(dir);
@@ -520,10 +1333,22 @@ file_create(const char *path, struct File **pf)
 
 // Open "path".  On success set *pf to point at the file and return 0.
 // On error return < 0.
+// PROJECT: fatfiles resolve to their latest version.
 int
 file_open(const char *path, struct File **pf, struct File** ff)
 {
-	return walk_path(path, 0, pf, 0, ff);
+	struct Walk w = { super->last_ts, WALK_RDONLY };
+
+	return walk_path(&w, 0, path, 0, pf, 0, ff);
+}
+
+// PROJECT: New function.
+// Like file_open, but walks the path as w says, and a relative path
+// starts at directory 'at'.
+int
+file_open_at(const struct Walk *w, struct File *at, const char *path, struct File **pf, struct File **ff)
+{
+	return walk_path(w, at, path, 0, pf, 0, ff);
 }
 
 // Read count bytes from f into buf, starting from seek position
@@ -543,8 +1368,9 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 
 	for (pos = offset; pos < offset + count; ) {
 
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_get_block_ro(f, pos / BLKSIZE, &blk)) < 0)	// PROJECT
 			return r;
+		bc_readahead(f, pos / BLKSIZE, blk);	// PROJECT
 
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 
@@ -568,13 +1394,17 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	// PROJECT: offset + count must fit in f_size.
+	if (offset < 0 || count > MAXFILESIZE - offset)
+		return -E_INVAL;
+
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
 			return r;
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_get_block_w(f, pos / BLKSIZE, &blk)) < 0)	// PROJECT
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(blk + pos % BLKSIZE, buf, bn);
@@ -593,10 +1423,15 @@ file_free_block(struct File *f, uint32_t filebno)
 	int r;
 	uint32_t *ptr;
 
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+	// PROJECT: look first, so no indirect block is allocated or
+	// copied for a block that is not there.
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) == -E_NOT_FOUND
+	    || (r == 0 && *ptr == 0))
+		return 0;
+	if ((r = file_block_walk_w(f, filebno, &ptr)) < 0)
 		return r;
 	if (*ptr) {
-		free_block(*ptr);
+		block_unref(*ptr);	// PROJECT
 		*ptr = 0;
 	}
 	return 0;
@@ -615,25 +1450,55 @@ static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
 	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t bno, old_nblocks, new_nblocks, i, keep, *dind;
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
-	for (bno = new_nblocks; bno < old_nblocks; bno++)
-		if ((r = file_free_block(f, bno)) < 0)
-			cprintf("warning: file_free_block: %e", r);
 
+	// PROJECT: drop whole indirect blocks first, so a shared one is
+	// not copied just to free the blocks in it.
+	if (new_nblocks <= NDIRECT + NINDIRECT && f->f_dindirect) {
+		indirect_unref(f->f_dindirect, 2);
+		f->f_dindirect = 0;
+		old_nblocks = MIN(old_nblocks, NDIRECT + NINDIRECT);
+	} else if (f->f_dindirect && new_nblocks < old_nblocks) {
+		// Drop the indirect blocks it lists past the new end.
+		keep = ROUNDUP(new_nblocks - NDIRECT - NINDIRECT, NINDIRECT) / NINDIRECT;
+		if (!(f->f_type & FTYPE_DIR)) {
+			if ((r = indirect_unshare(f->f_dindirect)) < 0) {
+				cprintf("warning: indirect_unshare: %e", r);
+				return;
+			}
+			f->f_dindirect = r;
+		}
+		dind = diskaddr(f->f_dindirect);
+		for (i = keep; i < NINDIRECT; i++)
+			if (dind[i]) {
+				indirect_unref(dind[i], 1);
+				dind[i] = 0;
+			}
+		old_nblocks = MIN(old_nblocks, NDIRECT + NINDIRECT + keep * NINDIRECT);
+	}
 	if (new_nblocks <= NDIRECT && f->f_indirect) {
-		free_block(f->f_indirect);
+		indirect_unref(f->f_indirect, 1);
 		f->f_indirect = 0;
+		old_nblocks = MIN(old_nblocks, NDIRECT);
 	}
+
+	for (bno = new_nblocks; bno < old_nblocks; bno++)
+		if ((r = file_free_block(f, bno)) < 0)
+			cprintf("warning: file_free_block: %e", r);
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// PROJECT: blocks of a versioned file may be shared with its other
+// versions, so they are only released when reference counts are kept.
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize && f->f_timestamp == 0)
+	if (newsize < 0 || newsize > MAXFILESIZE)	// PROJECT
+		return -E_INVAL;
+	if (f->f_size > newsize && (f->f_timestamp == 0 || refmap))
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
 	flush_block(f);
@@ -641,33 +1506,131 @@ file_set_size(struct File *f, off_t newsize)
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// PROJECT: Rather than looping over all the blocks in the file, write
+// out the blocks on f's dirty list, which file_get_block and file_write
+// keep, so the cost follows the amount of dirty data.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
-
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
-	}
+	bc_flush_file(f);
 	flush_block(f);
 	if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	if (f->f_dindirect)	// PROJECT
+		flush_block(diskaddr(f->f_dindirect));
+	if (f->f_htree)		// PROJECT
+		flush_block(diskaddr(f->f_htree));
+	bc_flush_file(0);	// PROJECT: reference counts
+}
+
+// PROJECT: New function.
+// Return the lock that guards the size and blocks of file f while
+// workers read and write it with fs_ns held shared.  Files share a
+// fixed set of locks, picked by where f is.
+struct Lock*
+file_lock(struct File *f)
+{
+	static struct Lock locks[64];
+
+	return &locks[((uint32_t) f / sizeof(struct File)) % 64];
 }
 
 
 // Sync the entire file system.  A big hammer.
+// PROJECT: only blocks in the block cache are looked at, see bc_sync.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync();
+}
+
+
+// --------------------------------------------------------------
+// Version pruning	// PROJECT
+// --------------------------------------------------------------
+
+// Remove the versions of fatfile ff that rp does not keep, release the
+// blocks only they referenced, and compact the remaining records.
+// A relative rp->r_keep_since counts back from the last timestamp now.
+// The caller makes sure no open file points into ff.
+// Returns the number of versions removed, < 0 on error.
+int
+ff_prune(struct File *ff, const struct Retention *rp)
+{
+	uint32_t i, j, nvers, nblocks, bno;
+	struct File *f;
+	struct Retention policy;
+
+	if ((ff->f_type & FTYPE_FF) == 0)
+		return -E_INVAL;
+	// Without reference counts we cannot tell which blocks are shared.
+	if (refmap == 0)
+		return -E_NOT_SUPP;
+	if (!retention_active(rp))
+		return 0;
+
+	policy = *rp;
+	if (policy.r_keep_since < 0)
+		policy.r_keep_since = MAX(super->last_ts + policy.r_keep_since, 1);
+	rp = &policy;
+
+	if (ff->f_nvers == 0 && ff->f_size > 0)
+		ff_count_versions(ff);
+	nvers = ff->f_nvers;
+
+	for (i = j = 0; i < nvers; i++) {
+		f = ff_version(ff, i);
+		if (ff_keep(ff, i, rp)) {
+			if (i != j) {
+				memmove(ff_version(ff, j), f, sizeof(struct File));
+				bc_dirty(ff_version(ff, j), ff);
+			}
+			j++;
+			continue;
+		}
+		file_truncate_blocks(f, 0);
+		if (f->f_htree)
+			block_unref(f->f_htree);
+	}
+	for (i = j; i < nvers; i++) {
+		memset(ff_version(ff, i), 0, sizeof(struct File));
+		bc_dirty(ff_version(ff, i), ff);
+	}
+	ff->f_nvers = j;
+	dcache_flush();	// directory versions may have moved
+
+	// Give back the record blocks that are now empty.
+	nblocks = MAX((j + BLKFILES - 1) / BLKFILES, 1);
+	if (ff->f_size > nblocks * BLKSIZE) {
+		file_truncate_blocks(ff, nblocks * BLKSIZE);
+		ff->f_size = nblocks * BLKSIZE;
+	}
+
+	file_flush(ff);
+	for (bno = 0; bno < super->s_nblocks; bno += BLKBITSIZE)
+		flush_block(&bitmap[bno / 32]);
+	return nvers - j;
 }
 
+// Prune the fatfiles that got new versions since the last pass with the
+// default retention policy.  Fatfiles for which busy() is true are
+// left for a later pass.
+void
+fs_prune_pass(bool (*busy)(struct File *ff))
+{
+	struct File *queue[NPRUNEQ];
+	int i, n, r;
+
+	n = nprune;
+	memmove(queue, prune_queue, n * sizeof(queue[0]));
+	nprune = 0;
+
+	for (i = 0; i < n; i++) {
+		if (busy(queue[i])) {
+			prune_enqueue(queue[i]);
+			continue;
+		}
+		if ((r = ff_prune(queue[i], &retention)) < 0)
+			cprintf("warning: ff_prune %s: %e\n", queue[i]->f_name, r);
+	}
+}
@@ -8,18 +8,62 @@
  * server's address space at DISKMAP + (n*BLKSIZE). */
 #define DISKMAP		0x10000000
 
-/* Maximum disk size we can handle (3GB) */
-#define DISKSIZE	0xC0000000
+/* PROJECT: Block cache pages that are being written to disk in the
+ * background are also mapped here, one page per IDE request slot. */
+#define IDESTAGE	0xE0000000
+
+/* PROJECT: Each worker has its own page tables from UPRIVATE on (see
+ * sfork), and there its request page, the client pages of a direct read
+ * or write, and the blocks the block cache is reading from disk */
+#define FSREQVA		UPRIVATE
+#define XFERVA		(FSREQVA + PGSIZE)
+#define READVA		(XFERVA + MAXIOPAGES * PGSIZE)
+
+/* PROJECT: A block cache page being dropped is mapped here meanwhile */
+#define EVICTVA		0xDE000000
+
+/* PROJECT: Client rings (struct Fsring) are mapped here, one page each */
+#define RINGVA		0xDC000000
+
+/* PROJECT: Block cache pages mapped into clients by FSREQ_MAP are also
+ * mapped here while a client may still map them */
+#define MAPVA		0xDA000000
+
+/* PROJECT: Default number of blocks the block cache may keep in memory */
+#define BC_BUDGET	1024
+
+/* PROJECT: Number of environments serving requests */
+#define NWORKERS	4
 
 /* walk_path modes */
 #define	WALK_RDONLY	0x0	// read only. don't create new timestamp
 #define	WALK_CREATE	0x1	// create new timestamp
 
-int walk_mode;	// PROJECT
-ts_t track_ts;	// PROJECT
+/* PROJECT: How one request walks paths */
+struct Walk {
+	ts_t w_ts;	// fatfiles resolve to their latest version <= w_ts
+	int w_mode;	// WALK_RDONLY or WALK_CREATE
+};
+
+/* PROJECT: Locks shared by the workers (lock.c) */
+struct Lock {
+	volatile uint32_t l_locked;
+};
+
+struct RWLock {
+	struct Lock rw_lock;	// guards the fields below
+	int rw_readers;		// number of shared holders
+	bool rw_writer;		// held or claimed exclusively
+};
+
+struct Retention retention;	// PROJECT: policy of the background pruning
+struct Fsstats fs_counters;		// PROJECT: counters for FSREQ_STATS, not locked
+struct RWLock fs_ns;		// PROJECT: directories and versions, see serv.c
 
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+uint32_t *refmap;		// PROJECT: reference count blocks mapped in memory, NULL if none
+extern char zero_block[];	// PROJECT: what holes read as
 
 /* ide.c */
 bool	ide_probe_disk1(void);
@@ -27,20 +71,32 @@ void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+int	ide_set_dma(bool on);	// PROJECT
+int	ide_write_async(uint32_t secno, const void *src, size_t nsecs);	// PROJECT
+void	ide_intr(void);		// PROJECT
+void	ide_drain(void);	// PROJECT
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_dirty(void *addr, struct File *owner);	// PROJECT
+void	bc_flush_file(struct File *owner);	// PROJECT
+void	bc_sync(void);			// PROJECT
+void	bc_readahead(struct File *f, uint32_t filebno, void *addr);	// PROJECT
 void	bc_init(void);
-void 	garbage_collector(void); // Challenge
+void	bc_set_budget(uint32_t nblocks);	// PROJECT
 
 /* fs.c */
 void		fs_init(void);
 int		file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int		file_get_block_ro(struct File *f, uint32_t file_blockno, char **pblk);	// PROJECT
+uint32_t	file_block_run(struct File *f, uint32_t file_blockno, uint32_t n);	// PROJECT
 int		file_create(const char *path, struct File **f);
 int		file_open(const char *path, struct File **f, struct File** ff);
+int		file_create_at(const struct Walk *w, struct File *at, const char *path, struct File **f);	// PROJECT
+int		file_open_at(const struct Walk *w, struct File *at, const char *path, struct File **f, struct File **ff);	// PROJECT
 ssize_t		file_read(struct File *f, void *buf, size_t count, off_t offset);
 int		file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int		file_set_size(struct File *f, off_t newsize);
@@ -48,11 +104,27 @@ void		file_flush(struct File *f);
 int		file_remove(const char *path);
 void		fs_sync(void);
 struct File*   	file_shalldup(struct File *ff, struct File *fromfile);   // PROJECT
+struct File*	ff_latest(struct File *ff);	// PROJECT
+int		ff_versions(struct File *ff, ts_t ts, struct File **vers, int n);	// PROJECT
+int		ff_prune(struct File *ff, const struct Retention *rp);	// PROJECT
+void		fs_prune_pass(bool (*busy)(struct File *ff));	// PROJECT
+struct Lock*	file_lock(struct File *f);	// PROJECT
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_blocks(uint32_t n, uint32_t goal);	// PROJECT
+void	free_block(uint32_t blockno);
+void	block_ref(uint32_t blockno);	// PROJECT
+void	block_unref(uint32_t blockno);	// PROJECT
 
 /* test.c */
 void	fs_test(void);
 
+/* lock.c */
+void	lock_acquire(struct Lock *l);	// PROJECT
+bool	lock_try(struct Lock *l);	// PROJECT
+void	lock_release(struct Lock *l);	// PROJECT
+void	rwlock_acquire(struct RWLock *rw, bool excl);	// PROJECT
+void	rwlock_release(struct RWLock *rw, bool excl);	// PROJECT
+
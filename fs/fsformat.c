@@ -45,6 +45,7 @@ uint32_t nblocks;
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
+uint32_t *refmap;	// PROJECT
 
 void
 panic(const char *fmt, ...)
@@ -91,7 +92,7 @@ alloc(uint32_t bytes)
 void
 opendisk(const char *name) // getting name=fs.img
 {
-	int r, diskfd, nbitblocks;
+	int r, diskfd, nbitblocks, nrefblocks;
 
 	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
 		panic("open %s: %s", name, strerror(errno));
@@ -121,6 +122,12 @@ opendisk(const char *name) // getting name=fs.img
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// PROJECT: no block is shared yet, so every count starts at 0.
+	nrefblocks = (nblocks + NREFPERBLK - 1) / NREFPERBLK;
+	refmap = alloc(nrefblocks * BLKSIZE);
+	memset(refmap, 0, nrefblocks * BLKSIZE);
+	super->s_refmap = blockof(refmap);
 }
 
 void
@@ -146,9 +153,22 @@ finishfile(struct File *f, uint32_t start, uint32_t len)
 	if (i == NDIRECT) {
 		uint32_t *ind = alloc(BLKSIZE);
 		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
+		for (; i < len / BLKSIZE && i < NDIRECT + NINDIRECT; ++i)
 			ind[i - NDIRECT] = start + i;
 	}
+	// PROJECT: the rest goes through the double-indirect block.
+	if (i == NDIRECT + NINDIRECT && i < len / BLKSIZE) {
+		uint32_t *dind = alloc(BLKSIZE), *ind = NULL;
+		f->f_dindirect = blockof(dind);
+		for (; i < len / BLKSIZE; ++i) {
+			uint32_t j = i - NDIRECT - NINDIRECT;
+			if (j % NINDIRECT == 0) {
+				ind = alloc(BLKSIZE);
+				dind[j / NINDIRECT] = blockof(ind);
+			}
+			ind[j % NINDIRECT] = start + i;
+		}
+	}
 	f->f_timestamp = 0;	// PROJECT: A file that existed at the time the FS was created is given a ts 0
 }
 
@@ -166,6 +186,7 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	struct File *out = &d->ents[d->n++];
 	if (d->n > MAX_DIR_ENTS)
 		panic("too many directory entries");
+	memset(out, 0, sizeof *out);
 	strcpy(out->f_name, name);
 	out->f_type = type;
 	return out;
@@ -236,8 +257,9 @@ main(int argc, char **argv)
 	if (argc < 3)
 		usage();
 
+	// PROJECT: up to the DISKSIZE the file server maps
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > DISKSIZE / BLKSIZE)
 		usage();
 
 	opendisk(argv[1]);
@@ -254,6 +276,7 @@ main(int argc, char **argv)
 	// timestamp 0 for pfs.ff
 	pfs0 = diradd(&pfs_dir, FTYPE_DIR, "pfs");
 	finishfile(pfs0, 0, 0);
+	pfs_ff->f_nvers = pfs_dir.n;
 
 	finishdir(&pfs_dir);
 // PROJECT: end
@@ -1,7 +1,19 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * IDE driver code: PIO, or bus-master DMA on a PCI IDE controller
+ * that supports it (like QEMU's PIIX), completing by polling or, when
+ * the kernel routes IRQ 14 to us, by interrupt.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
+ *
+ * PROJECT: ide_set_dma switches ide_read and ide_write to DMA, so the
+ * data no longer goes through the CPU.  DMA requests go through a
+ * queue ordered by an elevator, and with interrupts ide_write_async
+ * returns before the disk is done.
+ *
+ * PROJECT: The file server workers share the driver.  ide_lock guards
+ * the controller and the queue; it is let go while a worker sleeps
+ * until the next interrupt, and whichever worker takes it next
+ * completes the active request.
  */
 
 #include "fs.h"
@@ -14,6 +26,72 @@
 
 static int diskno = 1;
 
+// PROJECT: Bus-master DMA.
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+#define PCI_CLASS_IDE	0x0101		// mass storage, IDE
+#define PCI_CMD_IO	0x0001
+#define PCI_CMD_MASTER	0x0004
+
+#define BM_CMD		0		// bus master command register
+#define BM_STATUS	2		// bus master status register
+#define BM_PRDT		4		// PRD table address register
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08		// device to memory
+#define BM_ST_ERR	0x02
+#define BM_ST_INTR	0x04
+
+#define PRD_EOT		0x8000
+
+#define NIDEREQ		64		// PROJECT: disk request slots
+
+// Physical Region Descriptor: one physically contiguous piece of a
+// transfer.  A transfer of at most 256 sectors from page sized pieces
+// needs no more than (256 * SECTSIZE) / PGSIZE + 1 entries.
+struct Prd {
+	uint32_t p_addr;
+	uint16_t p_count;
+	uint16_t p_flags;
+};
+
+#define NPRD	((256 * SECTSIZE) / PGSIZE + 1)
+
+// PROJECT: One PRD table per request slot, filled when the request is
+// queued, since the buffer may be mapped only in the worker queueing
+// it.  64 entries keep each table inside one page.
+static struct Prd prdt[NIDEREQ][64] __attribute__((aligned(PGSIZE)));
+static struct Lock ide_lock;
+
+static void ide_wait_idle(void);
+static uint16_t bmide;		// bus master I/O base, 0 if none
+static bool use_dma;
+static bool use_irq;		// DMA completion is signalled by IRQ 14
+
+// PROJECT: Disk request queue, used with DMA.  Only one request is on
+// the disk at a time; the others wait here to be picked by ide_pick.
+#define WRITE_EXPIRE	16
+
+enum {
+	REQ_FREE = 0,
+	REQ_QUEUED,
+	REQ_ACTIVE,
+	REQ_DONE
+};
+
+static struct IdeReq {
+	int r_state;
+	bool r_write;
+	bool r_async;		// no one waits for it; free the slot when done
+	uint32_t r_secno;
+	uint32_t r_nsecs;
+	const void *r_va;
+	uint32_t r_passed;	// reads sent to the disk while it was queued
+	int r_result;
+} idereq[NIDEREQ];
+
+static struct IdeReq *ide_active;	// the request the disk is working on
+static uint32_t ide_head;		// sector after the last request started
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -59,6 +137,359 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
+// PROJECT: Read a register of PCI function bus:dev.func.
+static uint32_t
+pci_conf_read(int bus, int dev, int func, int off)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (bus << 16) | (dev << 11)
+	     | (func << 8) | (off & 0xFC));
+	return inl(PCI_CONF_DATA);
+}
+
+static void
+pci_conf_write(int bus, int dev, int func, int off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (bus << 16) | (dev << 11)
+	     | (func << 8) | (off & 0xFC));
+	outl(PCI_CONF_DATA, v);
+}
+
+// PROJECT: Find the IDE controller on PCI bus 0 and its bus master
+// registers (BAR4), and let it master the bus.
+// Returns 0 on success, -E_NOT_SUPP if there is no such controller.
+static int
+ide_dma_probe(void)
+{
+	int dev, func;
+	uint32_t id, class, bar4, cmd;
+
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			id = pci_conf_read(0, dev, func, 0x00);
+			if ((id & 0xFFFF) == 0xFFFF)
+				continue;
+			class = pci_conf_read(0, dev, func, 0x08) >> 16;
+			bar4 = pci_conf_read(0, dev, func, 0x20);
+			if (class != PCI_CLASS_IDE || !(bar4 & 1))
+				continue;
+
+			cmd = pci_conf_read(0, dev, func, 0x04);
+			pci_conf_write(0, dev, func, 0x04,
+				       cmd | PCI_CMD_IO | PCI_CMD_MASTER);
+			bmide = bar4 & 0xFFFC;
+			return 0;
+		}
+	return -E_NOT_SUPP;
+}
+
+// PROJECT: Use bus-master DMA for disk transfers if 'on' and the
+// controller supports it, PIO otherwise.  With DMA, transfers are
+// interrupt driven if the kernel lets us have IRQ 14.
+// Returns 0 if the requested mode is in use, -E_NOT_SUPP if DMA was
+// asked for but is not available (PIO stays in use).
+int
+ide_set_dma(bool on)
+{
+	int r = 0;
+
+	lock_acquire(&ide_lock);
+	ide_wait_idle();
+	use_dma = use_irq = false;
+	if (!on)
+		goto out;
+	if (!bmide && (r = ide_dma_probe()) < 0)
+		goto out;
+	use_dma = true;
+
+	if (sys_irq_listen(IRQ_IDE) == 0) {
+		outb(0x3F6, 0);		// clear nIEN: let the drive interrupt
+		use_irq = true;
+	}
+out:
+	lock_release(&ide_lock);
+	return r;
+}
+
+// PROJECT: Is every page of the 'n' bytes at 'va' mapped?
+static bool
+ide_mapped(const void *va, size_t n)
+{
+	const void *end = va + n;
+
+	for (va = ROUNDDOWN(va, PGSIZE); va < end; va += PGSIZE)
+		if (!va_is_mapped((void *) va))
+			return false;
+	return true;
+}
+
+// PROJECT: Fill the PRD table of request r from its buffer, which must
+// be mapped.
+static void
+ide_dma_prdt(struct IdeReq *r)
+{
+	struct Prd *prd = prdt[r - idereq];
+	const void *va = r->r_va;
+	size_t len, n = r->r_nsecs * SECTSIZE;
+	int i;
+
+	static_assert(NPRD <= 64);
+	for (i = 0; n > 0; i++, va += len, n -= len) {
+		len = MIN(n, PGSIZE - PGOFF(va));
+		prd[i].p_addr = PTE_ADDR(uvpt[PGNUM(va)]) | PGOFF(va);
+		prd[i].p_count = len;
+		prd[i].p_flags = 0;
+	}
+	prd[i - 1].p_flags = PRD_EOT;
+}
+
+// PROJECT: Start the DMA command for request r.
+static void
+ide_dma_start(struct IdeReq *r)
+{
+	uint8_t dir = r->r_write ? 0 : BM_CMD_READ;
+	struct Prd *prd = prdt[r - idereq];
+
+	ide_wait_ready(0);
+
+	outl(bmide + BM_PRDT, PTE_ADDR(uvpt[PGNUM(prd)]) | PGOFF(prd));
+	outb(bmide + BM_CMD, dir);
+	outb(bmide + BM_STATUS, inb(bmide + BM_STATUS) | BM_ST_ERR | BM_ST_INTR);
+
+	outb(0x1F2, r->r_nsecs);
+	outb(0x1F3, r->r_secno & 0xFF);
+	outb(0x1F4, (r->r_secno >> 8) & 0xFF);
+	outb(0x1F5, (r->r_secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((r->r_secno>>24)&0x0F));
+	outb(0x1F7, r->r_write ? 0xCA : 0xC8);	// WRITE DMA / READ DMA
+
+	outb(bmide + BM_CMD, dir | BM_CMD_START);
+}
+
+// PROJECT: Choose the next queued request to send to the disk.
+// Reads go before writes, since someone is waiting for them, and each
+// kind is served in one sweep of ascending sectors from the head
+// position (C-LOOK).  A write that let WRITE_EXPIRE reads pass goes
+// next, so writes are not put off forever.
+static struct IdeReq *
+ide_pick(void)
+{
+	struct IdeReq *r, *next, *first;
+	int write;
+
+	for (r = idereq; r < idereq + NIDEREQ; r++)
+		if (r->r_state == REQ_QUEUED && r->r_write
+		    && r->r_passed >= WRITE_EXPIRE)
+			return r;
+
+	for (write = 0; write <= 1; write++) {
+		next = first = NULL;
+		for (r = idereq; r < idereq + NIDEREQ; r++) {
+			if (r->r_state != REQ_QUEUED || r->r_write != write)
+				continue;
+			if (!first || r->r_secno < first->r_secno)
+				first = r;
+			if (r->r_secno >= ide_head
+			    && (!next || r->r_secno < next->r_secno))
+				next = r;
+		}
+		if (next || first)
+			return next ? next : first;
+	}
+	return NULL;
+}
+
+// PROJECT: Start the next request if the disk is idle.
+static void
+ide_dispatch(void)
+{
+	struct IdeReq *r, *w;
+
+	if (ide_active || (r = ide_pick()) == NULL)
+		return;
+
+	if (!r->r_write)
+		for (w = idereq; w < idereq + NIDEREQ; w++)
+			if (w->r_state == REQ_QUEUED && w->r_write)
+				w->r_passed++;
+
+	r->r_state = REQ_ACTIVE;
+	ide_active = r;
+	ide_head = r->r_secno + r->r_nsecs;
+	ide_dma_start(r);
+}
+
+// PROJECT: Complete the active request if the controller is done with
+// it and start the next one.  Called with ide_lock held.
+static void
+ide_poll(void)
+{
+	struct IdeReq *r = ide_active;
+	uint8_t status;
+
+	if (!r || !((status = inb(bmide + BM_STATUS)) & (BM_ST_INTR|BM_ST_ERR)))
+		return;
+
+	outb(bmide + BM_CMD, 0);
+	outb(bmide + BM_STATUS, status | BM_ST_ERR | BM_ST_INTR);
+
+	r->r_result = (ide_wait_ready(1) < 0 || (status & BM_ST_ERR)) ? -1 : 0;
+	ide_active = NULL;
+
+	if (r->r_async) {
+		if (r->r_result < 0)
+			panic("ide_intr: write of sector %d failed", r->r_secno);
+		sys_page_unmap(0, (void *) ROUNDDOWN(r->r_va, PGSIZE));
+		r->r_state = REQ_FREE;
+	} else
+		r->r_state = REQ_DONE;
+
+	ide_dispatch();
+}
+
+// PROJECT: Called on IRQ 14, which serve() receives as an IPC from
+// envid 0.
+void
+ide_intr(void)
+{
+	lock_acquire(&ide_lock);
+	ide_poll();
+	lock_release(&ide_lock);
+}
+
+// PROJECT: Wait for the disk to finish the active request.  Other
+// workers may use the queue meanwhile.  Each of them sees every IRQ
+// 14, so whoever completes the request, we are woken up.
+static void
+ide_wait_intr(void)
+{
+	lock_release(&ide_lock);
+	if (use_irq)
+		sys_irq_wait();
+	lock_acquire(&ide_lock);
+	ide_poll();
+}
+
+// PROJECT: Wait until every queued request is done.
+static void
+ide_wait_idle(void)
+{
+	while (ide_active)
+		ide_wait_intr();
+}
+
+void
+ide_drain(void)
+{
+	lock_acquire(&ide_lock);
+	ide_wait_idle();
+	lock_release(&ide_lock);
+}
+
+// PROJECT: Get a free request slot, waiting for one if all are taken.
+static struct IdeReq *
+ide_alloc(void)
+{
+	struct IdeReq *r;
+
+	for (;;) {
+		for (r = idereq; r < idereq + NIDEREQ; r++)
+			if (r->r_state == REQ_FREE)
+				return r;
+		ide_wait_intr();
+	}
+}
+
+// PROJECT: Is a write to some of the nsecs sectors at secno queued or
+// in progress?
+static bool
+ide_writing(uint32_t secno, size_t nsecs)
+{
+	struct IdeReq *r;
+
+	for (r = idereq; r < idereq + NIDEREQ; r++)
+		if ((r->r_state == REQ_QUEUED || r->r_state == REQ_ACTIVE)
+		    && r->r_write && r->r_secno < secno + nsecs
+		    && secno < r->r_secno + r->r_nsecs)
+			return true;
+	return false;
+}
+
+// PROJECT: Queue a request and start it if the disk is idle.
+static struct IdeReq *
+ide_queue(uint32_t secno, const void *va, size_t nsecs, bool write, bool async)
+{
+	struct IdeReq *r = ide_alloc();
+
+	r->r_secno = secno;
+	r->r_va = va;
+	r->r_nsecs = nsecs;
+	r->r_write = write;
+	r->r_async = async;
+	r->r_passed = 0;
+	ide_dma_prdt(r);
+	r->r_state = REQ_QUEUED;
+	ide_dispatch();
+	return r;
+}
+
+// PROJECT: Move nsecs sectors at secno to (write == 0) or from
+// (write == 1) the buffer at va with DMA, and wait for it.
+// Returns -E_FAULT if part of the buffer is not mapped, in which case
+// the transfer has to go through PIO.
+static int
+ide_dma(uint32_t secno, const void *va, size_t nsecs, bool write)
+{
+	struct IdeReq *r;
+	int result;
+
+	if (!ide_mapped(va, nsecs * SECTSIZE))
+		return -E_FAULT;
+
+	// A read must not pass a write of the same sectors.
+	if (!write && ide_writing(secno, nsecs))
+		ide_wait_idle();
+
+	r = ide_queue(secno, va, nsecs, write, 0);
+	while (r->r_state != REQ_DONE)
+		ide_wait_intr();
+	result = r->r_result;
+	r->r_state = REQ_FREE;
+	return result;
+}
+
+// PROJECT: Write nsecs sectors from src to secno without waiting for
+// the disk, when transfers are interrupt driven.  src must be a page
+// aligned block cache page.  The page is mapped again at IDESTAGE until
+// the write is done, so the cache may drop it meanwhile.
+int
+ide_write_async(uint32_t secno, const void *src, size_t nsecs)
+{
+	struct IdeReq *r;
+	void *stage;
+	int err = 0;
+
+	if (!use_irq || nsecs > BLKSECTS || PGOFF(src) || !ide_mapped(src, PGSIZE))
+		return ide_write(secno, src, nsecs);
+
+	lock_acquire(&ide_lock);
+	// A write of the same block that has not started yet will
+	// write the page as it is now.
+	for (r = idereq; r < idereq + NIDEREQ; r++)
+		if (r->r_state == REQ_QUEUED && r->r_write
+		    && r->r_secno == secno && r->r_nsecs == nsecs)
+			goto out;
+
+	r = ide_alloc();
+	stage = (void *) (IDESTAGE + (r - idereq) * PGSIZE);
+	if ((err = sys_page_map(0, (void *) src, 0, stage, PTE_P|PTE_U)) < 0)
+		goto out;
+	ide_queue(secno, stage, nsecs, 1, 1);
+	fs_counters.st_wcmds++;
+	fs_counters.st_wsects += nsecs;
+out:
+	lock_release(&ide_lock);
+	return err;
+}
 
 int
 ide_read(uint32_t secno, void *dst, size_t nsecs)
@@ -67,6 +498,16 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	lock_acquire(&ide_lock);	// PROJECT
+	fs_counters.st_rcmds++;		// PROJECT
+	fs_counters.st_rsects += nsecs;	// PROJECT
+
+	// PROJECT: Buffers that are not all mapped fall back to PIO,
+	// once the disk is done with the queue.
+	if (use_dma && (r = ide_dma(secno, dst, nsecs, 0)) != -E_FAULT)
+		goto out;
+	ide_wait_idle();
+
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -76,13 +517,15 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
 	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
 
-	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
+	for (r = 0; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
-			return r;
+			break;
 		insl(0x1F0, dst, SECTSIZE/4);
 	}
 
-	return 0;
+out:
+	lock_release(&ide_lock);	// PROJECT
+	return r;
 }
 
 int
@@ -92,6 +535,14 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	lock_acquire(&ide_lock);	// PROJECT
+	fs_counters.st_wcmds++;		// PROJECT
+	fs_counters.st_wsects += nsecs;	// PROJECT
+
+	if (use_dma && (r = ide_dma(secno, src, nsecs, 1)) != -E_FAULT)	// PROJECT
+		goto out;
+	ide_wait_idle();	// PROJECT
+
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -101,12 +552,14 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
 	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
 
-	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
+	for (r = 0; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
-			return r;
+			break;
 		outsl(0x1F0, src, SECTSIZE/4);
 	}
 
-	return 0;
+out:
+	lock_release(&ide_lock);	// PROJECT
+	return r;
 }
 
@@ -0,0 +1,78 @@
+/*
+ * PROJECT: Locks for the file server workers, which share all of their
+ * memory but the stacks (see sfork).  A worker holding a lock may be
+ * descheduled, so waiters give up the CPU now and then rather than
+ * spin for their whole time slice.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define SPINS	64	// tries before a waiter yields
+
+// Back off after the n'th failed try.
+static void
+lock_wait(int n)
+{
+	if (n % SPINS == SPINS - 1)
+		sys_yield();
+	else
+		asm volatile("pause");
+}
+
+void
+lock_acquire(struct Lock *l)
+{
+	int n;
+
+	for (n = 0; xchg(&l->l_locked, 1) != 0; n++)
+		lock_wait(n);
+}
+
+// Take l if it is free.  Returns true if we got it.
+bool
+lock_try(struct Lock *l)
+{
+	return xchg(&l->l_locked, 1) == 0;
+}
+
+void
+lock_release(struct Lock *l)
+{
+	xchg(&l->l_locked, 0);
+}
+
+// Take rw shared, or exclusively if 'excl'.  A writer claims rw first
+// and then waits for the readers to leave; new readers wait for it, so
+// writers are not starved.
+void
+rwlock_acquire(struct RWLock *rw, bool excl)
+{
+	bool claimed = 0;
+	int n;
+
+	for (n = 0; ; n++) {
+		lock_acquire(&rw->rw_lock);
+		if (excl && !claimed && !rw->rw_writer)
+			rw->rw_writer = claimed = 1;
+		if (excl ? claimed && rw->rw_readers == 0 : !rw->rw_writer) {
+			if (!excl)
+				rw->rw_readers++;
+			lock_release(&rw->rw_lock);
+			return;
+		}
+		lock_release(&rw->rw_lock);
+		lock_wait(n);
+	}
+}
+
+void
+rwlock_release(struct RWLock *rw, bool excl)
+{
+	lock_acquire(&rw->rw_lock);
+	if (excl)
+		rw->rw_writer = 0;
+	else
+		rw->rw_readers--;
+	lock_release(&rw->rw_lock);
+}
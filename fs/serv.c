@@ -35,64 +35,225 @@ struct OpenFile {
 	struct File *o_fatfile;	// PROJECT: the fatfile that contain the file. NULL if there is no such one.
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	bool o_newver;		// PROJECT: o_file is the version this open created
+	struct OpenFile *o_next;	// PROJECT: next on the free list
+	bool o_free;		// PROJECT: on the free list
+	struct Lock o_lock;	// PROJECT: held by the request using the entry
 };
 
+// PROJECT: Workers.
+// NWORKERS environments run serve() at once, sforked from the first
+// one, so all of this memory but the stacks and the pages at FSREQVA,
+// XFERVA and READVA is shared.  Each client sends its requests to one
+// of them (see lib/file.c).  Locks, in the order they are taken:
+//
+//	r_lock		a ring, while a worker serves its entries
+//	o_lock		an open file, for the whole request that uses it;
+//			a directory handle while a path is walked from it
+//	fs_ns		the name space: directories, fatfiles and their
+//			version records.  Walks and file data requests take
+//			it shared; creating, pruning and starting a new
+//			version take it exclusively
+//	file_lock(f)	the size and blocks of f, taken with fs_ns shared
+//	mapped_lock, then in fs.c refmap_lock, bitmap_lock, dcache_lock,
+//	then bc_lock in bc.c and ide_lock in ide.c
+//
+// opentab_lock and rings_lock guard the free list and the ring slots.
+// fs_counters are bumped without a lock, so counts may be lost.
+
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
 
 // initialize to force into data section
 struct OpenFile opentab[MAXOPEN] = {
-	{ 0, 0, 0, 1, 0 }  // PROJECT: init o_fatfile to 0
+	{ 0, 0, 0, 1, 0, 0 }  // PROJECT: init o_fatfile and o_newver to 0
 };
 
+// PROJECT: Free open-file table entries.  Clients say when they close
+// a file; entries of clients that went away without closing are only
+// found when the list runs dry.
+static struct OpenFile *openfree;
+static struct Lock opentab_lock;
+
 // Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// PROJECT: Each worker has its own.
+union Fsipc *fsreq = (union Fsipc *)FSREQVA;
 
 void
 serve_init(void)
 {
 	int i;
 	uintptr_t va = FILEVA;
-	for (i = 0; i < MAXOPEN; i++) {
+	for (i = MAXOPEN - 1; i >= 0; i--) {	// PROJECT: so entry 0 is first
 		opentab[i].o_fileid = i;
-		opentab[i].o_fd = (struct Fd*) va;
-		va += PGSIZE;
+		opentab[i].o_fd = (struct Fd*) (va + i * PGSIZE);
+		opentab[i].o_next = openfree;
+		opentab[i].o_free = 1;
+		openfree = &opentab[i];
 	}
 }
 
+// PROJECT: New function.
+// Put o on the free list, with opentab_lock held.
+static void
+openfile_put(struct OpenFile *o)
+{
+	if (o->o_free)
+		return;
+	o->o_fileid += MAXOPEN;
+	o->o_file = 0;
+	o->o_fatfile = 0;
+	o->o_next = openfree;
+	o->o_free = 1;
+	openfree = o;
+}
+
+// PROJECT: New function.
+// Put o, which the caller has locked, on the free list.  Its file ID
+// changes, so requests still using the old one fail.
+static void
+openfile_free(struct OpenFile *o)
+{
+	lock_acquire(&opentab_lock);
+	openfile_put(o);
+	lock_release(&opentab_lock);
+}
+
+// PROJECT: New function.
+// Free the entries no client maps any more.  Entries in use by a
+// request are left alone: one being opened is not mapped by its
+// client yet.
+static void
+openfile_reclaim(void)
+{
+	int i;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (!opentab[i].o_free && pageref(opentab[i].o_fd) <= 1
+		    && lock_try(&opentab[i].o_lock)) {
+			if (pageref(opentab[i].o_fd) <= 1)
+				openfile_put(&opentab[i]);
+			lock_release(&opentab[i].o_lock);
+		}
+}
+
 // Allocate an open file.
+// PROJECT: take the head of the free list; scan the table for entries
+// of clients that never closed them only if it is empty.  The entry
+// is returned locked.
 int
 openfile_alloc(struct OpenFile **o)
 {
-	int i, r;
+	int r;
 
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
-		}
+	lock_acquire(&opentab_lock);
+	if (openfree == 0)
+		openfile_reclaim();
+	if (openfree == 0) {
+		lock_release(&opentab_lock);
+		return -E_MAX_OPEN;
 	}
-	return -E_MAX_OPEN;
+
+	// Entries start out without their Fd page.
+	if (pageref(openfree->o_fd) == 0
+	    && (r = sys_page_alloc(0, openfree->o_fd, PTE_P|PTE_U|PTE_W)) < 0) {
+		lock_release(&opentab_lock);
+		return r;
+	}
+
+	*o = openfree;
+	lock_acquire(&(*o)->o_lock);
+	openfree = (*o)->o_next;
+	(*o)->o_free = 0;
+	lock_release(&opentab_lock);
+	memset((*o)->o_fd, 0, PGSIZE);
+	return (*o)->o_fileid;
 }
 
 // Look up an open file for envid.
+// PROJECT: On success the entry is locked until openfile_unlock.
 int
 openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 {
 	struct OpenFile *o;
 
 	o = &opentab[fileid % MAXOPEN];
-	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
+	lock_acquire(&o->o_lock);
+	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid) {
+		lock_release(&o->o_lock);
 		return -E_INVAL;
+	}
+	*po = o;
+	return 0;
+}
+
+// PROJECT: New function.
+// Let other requests use o, which may be NULL.
+static void
+openfile_unlock(struct OpenFile *o)
+{
+	if (o)
+		lock_release(&o->o_lock);
+}
+
+// PROJECT: New function.
+// Take the locks a request needs to use o->o_file: fs_ns, exclusively
+// if 'excl', or shared and then the file's own lock.
+static void
+openfile_enter(struct OpenFile *o, bool excl)
+{
+	rwlock_acquire(&fs_ns, excl);
+	if (!excl)
+		lock_acquire(file_lock(o->o_file));
+}
+
+// PROJECT: New function.
+static void
+openfile_leave(struct OpenFile *o, bool excl)
+{
+	if (!excl)
+		lock_release(file_lock(o->o_file));
+	rwlock_release(&fs_ns, excl);
+}
+
+// PROJECT: New function.
+// Return the timestamp a request asked paths to be walked at.
+// Negative timestamps are relative to the last one.
+static ts_t
+walk_ts(ts_t req_ts)
+{
+	if(req_ts == TS_UNSPECIFIED)
+		return super->last_ts;
+	else if(req_ts < 0)
+		return super->last_ts + req_ts;
+	else
+		return req_ts;
+}
+
+// PROJECT: New function.
+// Set *at to the directory that handle dirid of envid stands for, the
+// fatfile when it has one so its latest version is walked, or NULL
+// for the root if dirid is -1.  The handle is left locked in *po, or
+// *po is NULL, so no chdir moves it while the caller walks from *at;
+// release it with openfile_unlock.
+static int
+dir_handle(envid_t envid, int dirid, struct File **at, struct OpenFile **po)
+{
+	struct OpenFile *o;
+	int r;
+
+	*at = 0;
+	*po = 0;
+	if (dirid == -1)
+		return 0;
+	if ((r = openfile_lookup(envid, dirid, &o)) < 0)
+		return r;
+	if (!(o->o_file->f_type & FTYPE_DIR)) {
+		openfile_unlock(o);
+		return -E_INVAL;
+	}
+	*at = o->o_fatfile ? o->o_fatfile : o->o_file;
 	*po = o;
 	return 0;
 }
@@ -100,6 +261,9 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
+// PROJECT: a relative req_path is walked from directory handle
+// req->req_dirid.  On success the new entry stays locked until serve()
+// has sent the Fd page, or openfile_reclaim could take it back first.
 int
 serve_open(envid_t envid, struct Fsreq_open *req,
 	   void **pg_store, int *perm_store)
@@ -108,20 +272,16 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	struct File *f;
 	int fileid;
 	int r;
-	struct OpenFile *o;
-	struct File *ff;	// PROJECT
-
-	if(req->req_ts == TS_UNSPECIFIED)	// PROJECT
-		track_ts = super->last_ts;
-	else if(req->req_ts < 0)
-		track_ts = super->last_ts + req->req_ts;
+	struct OpenFile *o, *d;	// PROJECT
+	struct File *ff, *at;	// PROJECT
+	struct Walk w;		// PROJECT
+	bool excl;		// PROJECT: the open changes the name space
+
+	w.w_ts = walk_ts(req->req_ts);	// PROJECT
+	if((req->req_omode & O_CREAT) || (req->req_omode & O_WRONLY))
+		w.w_mode = WALK_CREATE;
 	else
-		track_ts = req->req_ts;
-
-	if((req->req_omode & O_CREAT) || (req->req_omode & O_WRONLY))	// PROJECT
-		walk_mode = WALK_CREATE;
-	else
-		walk_mode = WALK_RDONLY;
+		w.w_mode = WALK_RDONLY;
 
 	if (debug)
 		cprintf("serve_open %08x %s 0x%x\n", envid, req->req_path, req->req_omode);
@@ -132,29 +292,45 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 		path[MAXPATHLEN-1] = '/';
 	path[MAXPATHLEN-2] = 0;
 
+	if ((r = dir_handle(envid, req->req_dirid, &at, &d)) < 0)	// PROJECT
+		return r;
+
 	// Find an open file ID
 	if ((r = openfile_alloc(&o)) < 0) {
 		if (debug)
 			cprintf("openfile_alloc failed: %e", r);
+		openfile_unlock(d);	// PROJECT
 		return r;
 	}
 	fileid = r;
 
+	// PROJECT: Creating a file or a version, or truncating one.
+	excl = w.w_mode == WALK_CREATE || (req->req_omode & O_TRUNC);
+	rwlock_acquire(&fs_ns, excl);
+
 	// Open the file
-	if(walk_mode == WALK_CREATE){	// PROJECT
-		if ((r = file_create(path, &f)) < 0) {
+	if(w.w_mode == WALK_CREATE){	// PROJECT
+		if ((r = file_create_at(&w, at, path, &f)) < 0) {
 			if (!(req->req_omode & O_EXCL) && r == -E_FILE_EXISTS)
 				goto try_open;
 			if (debug)
 				cprintf("file_create failed: %e", r);
-			return r;
+			goto fail;
+		}
+		// PROJECT: file_create does not return the fatfile.
+		// The new file only exists as of the last timestamp.
+		w.w_ts = super->last_ts;
+		if ((r = file_open_at(&w, at, path, &f, &ff)) < 0) {
+			if (debug)
+				cprintf("file_open failed: %e", r);
+			goto fail;
 		}
 	} else {
 try_open:
-		if ((r = file_open(path, &f, &ff)) < 0) {
+		if ((r = file_open_at(&w, at, path, &f, &ff)) < 0) {
 			if (debug)
 				cprintf("file_open failed: %e", r);
-			return r;
+			goto fail;
 		}
 	}
 
@@ -163,19 +339,14 @@ try_open:
 		if ((r = file_set_size(f, 0)) < 0) {
 			if (debug)
 				cprintf("file_set_size failed: %e", r);
-			return r;
+			goto fail;
 		}
 	}
-	
-	if ((r = file_open(path, &f, &ff)) < 0) {
-		if (debug)
-			cprintf("file_open failed: %e", r);
-		return r;
-	}
 
 	// Save the file pointer
 	o->o_file = f;
 	o->o_fatfile = ff;	// PROJECT
+	o->o_newver = 0;	// PROJECT
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
@@ -193,7 +364,16 @@ try_open:
 	*pg_store = o->o_fd;
 	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
 
+	rwlock_release(&fs_ns, excl);	// PROJECT
+	openfile_unlock(d);		// PROJECT
 	return 0;
+
+fail:
+	rwlock_release(&fs_ns, excl);	// PROJECT
+	openfile_unlock(d);
+	openfile_free(o);
+	openfile_unlock(o);
+	return r;
 }
 
 // Set the size of req->req_fileid to req->req_size bytes, truncating
@@ -217,7 +397,12 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 
 	// Second, call the relevant file system function (from fs/fs.c).
 	// On failure, return the error code to the client.
-	return file_set_size(o->o_file, req->req_size);
+	// PROJECT: With the locks the file needs, see openfile_enter.
+	openfile_enter(o, 0);
+	r = file_set_size(o->o_file, req->req_size);
+	openfile_leave(o, 0);
+	openfile_unlock(o);
+	return r;
 }
 
 // Read at most ipc->read.req_n bytes from the current seek position
@@ -241,16 +426,52 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	if((r = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset)) < 0)
+	openfile_enter(o, 0);	// PROJECT
+	r = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset);
+	openfile_leave(o, 0);	// PROJECT
+	if(r < 0){
+		openfile_unlock(o);
 		return r;
+	}
 	count = r;
 
 	o->o_fd->fd_offset += count;
+	openfile_unlock(o);	// PROJECT
 	
 	return count;
 }
 
 
+// PROJECT: Write n bytes from buf to open file o at its seek position
+// and advance it.  The first write of a session creates the new
+// version, with fs_ns held exclusively; the following ones extend it
+// in place until flush.
+// Returns the number of bytes written, or < 0 on error.
+static int
+openfile_write(struct OpenFile *o, const void *buf, size_t n)
+{
+	bool excl = o->o_fatfile && !o->o_newver;
+	int r;
+
+	openfile_enter(o, excl);
+	if(o->o_fatfile != 0){
+
+		if(!o->o_newver){
+			o->o_file = file_shalldup(o->o_fatfile, o->o_file);
+			o->o_fatfile->f_timestamp = super->last_ts;
+			o->o_newver = 1;
+		}
+
+		o->o_fd->fd_offset = o->o_file->f_size;
+	}
+
+	if((r = file_write(o->o_file, buf, n, o->o_fd->fd_offset)) > 0)
+		o->o_fd->fd_offset += r;
+
+	openfile_leave(o, excl);
+	return r;
+}
+
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
 // accordingly.  Extend the file if necessary.  Returns the number of
@@ -263,27 +484,340 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 
 	// LAB 5: Your code here.
 	struct OpenFile* o;
-	size_t count;
-	int r, i;
+	int r;
 
 	if((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	if(o->o_fatfile != 0){	// PROJECT
+	r = openfile_write(o, req->req_buf, req->req_n);	// PROJECT
+	openfile_unlock(o);	// PROJECT
+	return r;
+}
 
-		o->o_file = file_shalldup(o->o_fatfile, o->o_file);
-		o->o_fatfile->f_timestamp = super->last_ts;
+// PROJECT: Unmap the first 'npages' pages at XFERVA.
+static void
+xfer_unmap(int npages)
+{
+	while (npages-- > 0)
+		sys_page_unmap(0, (void *) (XFERVA + npages * PGSIZE));
+}
 
-		o->o_fd->fd_offset = o->o_file->f_size;
+// PROJECT: Map the client's pages under the req->req_n bytes at
+// req->req_buf at XFERVA, writable if 'write'.  Returns the address of
+// the buffer at XFERVA, or 0 if the client has not granted the pages.
+static void *
+xfer_map(envid_t envid, struct Fsreq_direct *req, bool write)
+{
+	uintptr_t va = ROUNDDOWN(req->req_buf, PGSIZE);
+	uintptr_t end = ROUNDUP(req->req_buf + req->req_n, PGSIZE);
+	int i;
+
+	for (i = 0; va < end; va += PGSIZE, i++)
+		if (sys_page_map(envid, (void *) va, 0, (void *) (XFERVA + i * PGSIZE),
+				 PTE_P | PTE_U | (write ? PTE_W : 0)) < 0) {
+			xfer_unmap(i);
+			return 0;
+		}
+	return (void *) (XFERVA + PGOFF(req->req_buf));
+}
+
+// PROJECT: Like serve_read and serve_write, but the bytes go straight
+// between the block cache and the client's pages, many pages per
+// request.  Returns the number of bytes moved, or < 0 on error.
+int
+serve_direct(envid_t envid, struct Fsreq_direct *req, bool write)
+{
+	struct OpenFile *o;
+	void *buf;
+	int r;
+
+	if (debug)
+		cprintf("serve_direct %08x %08x %08x %d\n", envid, req->req_fileid, req->req_n, write);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_n == 0)
+		goto out;
+	r = -E_INVAL;
+	if (req->req_buf >= UTOP || req->req_n > UTOP - req->req_buf
+	    || (ROUNDUP(req->req_buf + req->req_n, PGSIZE)
+		- ROUNDDOWN(req->req_buf, PGSIZE)) / PGSIZE > MAXIOPAGES)
+		goto out;
+
+	// The server writes the client's pages on a read.
+	r = -E_FAULT;
+	if ((buf = xfer_map(envid, req, !write)) == 0)
+		goto out;
+
+	if (write)
+		r = openfile_write(o, buf, req->req_n);
+	else {
+		openfile_enter(o, 0);
+		if ((r = file_read(o->o_file, buf, req->req_n, o->o_fd->fd_offset)) > 0)
+			o->o_fd->fd_offset += r;
+		openfile_leave(o, 0);
 	}
 
-	if((r = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset)) < 0)
+	xfer_unmap((ROUNDUP(req->req_buf + req->req_n, PGSIZE)
+		    - ROUNDDOWN(req->req_buf, PGSIZE)) / PGSIZE);
+out:
+	openfile_unlock(o);
+	return r;
+}
+
+int
+serve_read_direct(envid_t envid, struct Fsreq_direct *req)
+{
+	return serve_direct(envid, req, 0);
+}
+
+int
+serve_write_direct(envid_t envid, struct Fsreq_direct *req)
+{
+	return serve_direct(envid, req, 1);
+}
+
+// PROJECT: Blocks serve_map has mapped into clients.  Each one holds a
+// reference to its block, so the block is neither freed nor reused for
+// another file while a client may still read it, and a write to the
+// file copies the block instead of changing what the client sees.  Its
+// page is mapped at MAPVA too, so the page's reference count tells when
+// the last client has unmapped it.  The count is kept in the on-disk
+// table like any other; a crash in between leaves the block one
+// reference too many.
+#define NMAPPED		256
+
+static uint32_t mapped[NMAPPED];	// block of MAPVA page i, 0 if none
+static struct Lock mapped_lock;
+
+// PROJECT: New function.
+// Does any client still map the page of mapped[i]?
+static bool
+mapped_busy(int i)
+{
+	void *va = (void *) (MAPVA + i * PGSIZE);
+	void *blk = diskaddr(mapped[i]);
+	int refs = pageref(va) - 1;
+
+	// The block cache may still hold the same page.
+	if (va_is_mapped(blk) && PTE_ADDR(uvpt[PGNUM(blk)]) == PTE_ADDR(uvpt[PGNUM(va)]))
+		refs--;
+	return refs > 0;
+}
+
+// PROJECT: New function.
+// Drop the references of the mapped blocks that no client maps any
+// more, with mapped_lock held.
+static void
+mapped_sweep(void)
+{
+	int i;
+
+	for (i = 0; i < NMAPPED; i++)
+		if (mapped[i] && !mapped_busy(i)) {
+			sys_page_unmap(0, (void *) (MAPVA + i * PGSIZE));
+			block_unref(mapped[i]);
+			mapped[i] = 0;
+		}
+}
+
+// PROJECT: New function.
+static void
+mapped_reclaim(void)
+{
+	lock_acquire(&mapped_lock);
+	mapped_sweep();
+	lock_release(&mapped_lock);
+}
+
+// PROJECT: New function.
+// Hold block cache page blk for clients that are about to map it, and
+// set *va_store to where it is held, which the block cache cannot
+// unmap.  Returns 0 on success, -E_NO_MEM if too many blocks are
+// mapped, -E_INVAL if blk is not cached (any more).
+static int
+mapped_hold(char *blk, void **va_store)
+{
+	uint32_t blockno = ((uint32_t) blk - DISKMAP) / BLKSIZE;
+	void *va;
+	int i, slot, r = 0;
+
+	lock_acquire(&mapped_lock);
+	slot = -1;
+	for (i = 0; i < NMAPPED; i++) {
+		va = (void *) (MAPVA + i * PGSIZE);
+		if (mapped[i] == blockno
+		    && PTE_ADDR(uvpt[PGNUM(va)]) == PTE_ADDR(uvpt[PGNUM(blk)]))
+			goto out;
+		if (mapped[i] == 0 && slot < 0)
+			slot = i;
+	}
+	if (slot < 0) {
+		mapped_sweep();
+		for (slot = 0; slot < NMAPPED && mapped[slot]; slot++)
+			/* do nothing */;
+		if (slot == NMAPPED) {
+			r = -E_NO_MEM;
+			goto out;
+		}
+	}
+
+	va = (void *) (MAPVA + slot * PGSIZE);
+	if ((r = sys_page_map(0, blk, 0, va, PTE_P | PTE_U)) < 0)
+		goto out;
+	block_ref(blockno);
+	mapped[slot] = blockno;
+out:
+	lock_release(&mapped_lock);
+	*va_store = va;
+	return r;
+}
+
+// PROJECT: Map the block cache pages holding req->req_npages pages of
+// the file from req->req_offset on read-only at req->req_va in the
+// client, so it reads them without any copy.  Pages past the end of
+// the file are not mapped.  The last page of the file is a copy with
+// zeroes past the end, since the rest of its block is not file data,
+// and a hole gets a fresh zeroed page.
+// Returns the number of bytes of the file mapped, or < 0 on error.
+int
+serve_map(envid_t envid, struct Fsreq_map *req)
+{
+	struct OpenFile *o;
+	char *blk;
+	void *va, *held;
+	off_t pos;
+	uint32_t i;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x %d\n", envid, req->req_fileid, req->req_offset, req->req_npages);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
-	count = r;
+	r = -E_INVAL;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE
+	    || req->req_npages > MAXIOPAGES || req->req_va % PGSIZE)
+		goto out;
+	// Without reference counts we could not hold the blocks.
+	r = -E_NOT_SUPP;
+	if (refmap == 0)
+		goto out;
+
+	openfile_enter(o, 0);
+	for (i = 0; i < req->req_npages; i++) {
+		pos = req->req_offset + i * BLKSIZE;
+		if (pos >= o->o_file->f_size)
+			break;
+		if ((r = file_get_block_ro(o->o_file, pos / BLKSIZE, &blk)) < 0)
+			goto leave;
+		va = (void *) (req->req_va + i * PGSIZE);
+
+		if (o->o_file->f_size - pos < BLKSIZE || blk == zero_block) {
+			// sys_page_alloc gives a zeroed page, which is all
+			// a hole needs.
+			if ((r = sys_page_alloc(0, (void *) XFERVA, PTE_P | PTE_U | PTE_W)) < 0)
+				goto leave;
+			if (blk != zero_block)
+				memmove((void *) XFERVA, blk, o->o_file->f_size - pos);
+			r = sys_page_map(0, (void *) XFERVA, envid, va, PTE_P | PTE_U);
+			sys_page_unmap(0, (void *) XFERVA);
+		} else {
+			// Another worker may evict the block before we
+			// hold it.
+			do
+				*(volatile char *) blk;	// bring it into the cache
+			while ((r = mapped_hold(blk, &held)) == -E_INVAL);
+			if (r < 0)
+				goto leave;
+			r = sys_page_map(0, held, envid, va, PTE_P | PTE_U);
+		}
+		if (r < 0)
+			goto leave;
+	}
+	r = MIN(i * BLKSIZE, o->o_file->f_size - req->req_offset);
+leave:
+	openfile_leave(o, 0);
+out:
+	openfile_unlock(o);
+	return r;
+}
 
-	o->o_fd->fd_offset += count;
+// PROJECT: Pack the entries of directory ipc->readdir.req_fileid from
+// its seek position on into ipc->readdirRet, each with the size and
+// timestamp of its latest version, and advance the seek position past
+// them.  Returns the number of bytes packed, 0 at the end of the
+// directory, or < 0 on error.
+int
+serve_readdir(envid_t envid, union Fsipc *ipc)
+{
+	struct OpenFile *o;
+	struct File *dir, *f, *cur;
+	struct Fsdirent *d;
+	char *blk;
+	uint32_t i, pos, reclen;
+	int r;
 
-	return count;
+	if (debug)
+		cprintf("serve_readdir %08x %08x\n", envid, ipc->readdir.req_fileid);
+
+	if ((r = openfile_lookup(envid, ipc->readdir.req_fileid, &o)) < 0)
+		return r;
+	dir = o->o_file;
+	if (!(dir->f_type & FTYPE_DIR)) {
+		openfile_unlock(o);
+		return -E_INVAL;
+	}
+
+	openfile_enter(o, 0);
+	pos = 0;
+	for (i = o->o_fd->fd_offset / sizeof(struct File);
+	     i < dir->f_size / sizeof(struct File); i++) {
+		if ((r = file_get_block_ro(dir, i / BLKFILES, &blk)) < 0)
+			goto out;
+		f = (struct File *) blk + i % BLKFILES;
+		if (f->f_name[0] == '\0')
+			continue;
+
+		reclen = ROUNDUP(sizeof(struct Fsdirent) + strlen(f->f_name) + 1, 4);
+		if (pos + reclen > PGSIZE)
+			break;
+
+		d = (struct Fsdirent *) (ipc->readdirRet.ret_buf + pos);
+		cur = ff_latest(f);
+		d->d_reclen = reclen;
+		d->d_type = f->f_type;
+		d->d_size = cur ? cur->f_size : 0;
+		d->d_ts = cur ? cur->f_timestamp : 0;
+		d->d_ffsize = (f->f_type & FTYPE_FF) ? f->f_size : 0;
+		d->d_ffts = (f->f_type & FTYPE_FF) ? f->f_timestamp : 0;
+		strcpy(d->d_name, f->f_name);
+		pos += reclen;
+	}
+
+	o->o_fd->fd_offset = i * sizeof(struct File);
+	r = pos;
+out:
+	openfile_leave(o, 0);
+	openfile_unlock(o);
+	return r;
+}
+
+// PROJECT: New function.
+// Fill in a Fsret_stat for f.
+static void
+stat_fill(struct File *f, struct Fsret_stat *ret)
+{
+	int i, num_blk;
+
+	strcpy(ret->ret_name, f->f_name);
+	ret->ret_size = f->f_size;
+	ret->ret_ftype = f->f_type;
+	ret->ret_ts = f->f_timestamp;
+
+	num_blk = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	for(i = 0; i < NDIRECT; ++i)
+		ret->ret_blkn[i] = (i < num_blk) ? f->f_direct[i] : 0;
 }
 
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
@@ -294,7 +828,7 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	struct Fsreq_stat *req = &ipc->stat;
 	struct Fsret_stat *ret = &ipc->statRet;
 	struct OpenFile *o;
-	int r, i, num_blk;
+	int r;
 
 	if (debug)
 		cprintf("serve_stat %08x %08x\n", envid, req->req_fileid);
@@ -302,17 +836,135 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	strcpy(ret->ret_name, o->o_file->f_name);
-	ret->ret_size = o->o_file->f_size;
-	ret->ret_ftype = o->o_file->f_type;
-	ret->ret_ts = o->o_file->f_timestamp;	// PROJECT
-
-	num_blk = (o->o_file->f_size + BLKSIZE - 1) / BLKSIZE;	 // PROJECT
-        for(i = 0; i < MIN(num_blk, NDIRECT); ++i)     
-                ret->ret_blkn[i] = o->o_file->f_direct[i];
+	openfile_enter(o, 0);		// PROJECT
+	stat_fill(o->o_file, ret);	// PROJECT
+	openfile_leave(o, 0);		// PROJECT
+	openfile_unlock(o);		// PROJECT
 	return 0;
 }
 
+// PROJECT: Point directory handle ipc->chdir.req_fileid at the latest
+// version of ipc->chdir.req_path, which is relative to the directory it
+// stands for now.  Every environment sharing the handle sees the change.
+int
+serve_chdir(envid_t envid, union Fsipc *ipc)
+{
+	char path[MAXPATHLEN];
+	struct OpenFile *o;
+	struct File *f, *ff, *at;
+	struct Walk w;
+	int r;
+
+	if (debug)
+		cprintf("serve_chdir %08x %08x %s\n", envid, ipc->chdir.req_fileid, ipc->chdir.req_path);
+
+	memmove(path, ipc->chdir.req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	if ((r = dir_handle(envid, ipc->chdir.req_fileid, &at, &o)) < 0)
+		return r;
+
+	rwlock_acquire(&fs_ns, 0);
+	w.w_ts = super->last_ts;
+	w.w_mode = WALK_RDONLY;
+	if ((r = file_open_at(&w, at, path, &f, &ff)) < 0)
+		goto out;
+	r = -E_INVAL;
+	if (!(f->f_type & FTYPE_DIR))
+		goto out;
+
+	o->o_file = f;
+	o->o_fatfile = ff;
+	o->o_fd->fd_offset = 0;
+	r = 0;
+out:
+	rwlock_release(&fs_ns, 0);
+	openfile_unlock(o);
+	return r;
+}
+
+// PROJECT: Stat ipc->stat_path.req_path as of ipc->stat_path.req_ts,
+// like an open and a stat but without allocating an OpenFile.  A
+// relative path is walked from directory handle req_dirid.
+int
+serve_stat_path(envid_t envid, union Fsipc *ipc)
+{
+	char path[MAXPATHLEN];
+	struct File *f, *ff, *at;
+	struct OpenFile *d;
+	struct Walk w;
+	int r;
+
+	if (debug)
+		cprintf("serve_stat_path %08x %s\n", envid, ipc->stat_path.req_path);
+
+	memmove(path, ipc->stat_path.req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	if ((r = dir_handle(envid, ipc->stat_path.req_dirid, &at, &d)) < 0)
+		return r;
+	rwlock_acquire(&fs_ns, 0);
+	w.w_ts = walk_ts(ipc->stat_path.req_ts);
+	w.w_mode = WALK_RDONLY;
+	if ((r = file_open_at(&w, at, path, &f, &ff)) == 0)
+		stat_fill(f, &ipc->statRet);
+	rwlock_release(&fs_ns, 0);
+	openfile_unlock(d);
+	return r;
+}
+
+// PROJECT: List the versions of ipc->versions.req_path with timestamp
+// <= ipc->versions.req_ts into ipc->versionsRet, newest first.  A
+// relative path is walked from directory handle req_dirid.
+// Returns the number of versions listed, 0 when there are no more.
+int
+serve_list_versions(envid_t envid, union Fsipc *ipc)
+{
+	char path[MAXPATHLEN];
+	struct File *f, *ff, *at, *vers[NVERSIONS];
+	struct Fsversion *v;
+	struct OpenFile *d;
+	struct Walk w = { super->last_ts, WALK_RDONLY };
+	ts_t ts;
+	int r, i, j, n, num_blk;
+
+	if (debug)
+		cprintf("serve_list_versions %08x %s\n", envid, ipc->versions.req_path);
+
+	memmove(path, ipc->versions.req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+	ts = ipc->versions.req_ts;
+
+	if ((r = dir_handle(envid, ipc->versions.req_dirid, &at, &d)) < 0)
+		return r;
+	rwlock_acquire(&fs_ns, 0);
+	if ((r = file_open_at(&w, at, path, &f, &ff)) < 0)
+		goto out;
+
+	ts = walk_ts(ts);
+	if (ff)
+		n = ff_versions(ff, ts, vers, NVERSIONS);
+	else {
+		vers[0] = f;
+		n = (f->f_timestamp <= ts);
+	}
+
+	strcpy(ipc->versionsRet.ret_name, f->f_name);
+	for (i = 0; i < n; i++) {
+		v = &ipc->versionsRet.ret_vers[i];
+		v->v_ts = vers[i]->f_timestamp;
+		v->v_size = vers[i]->f_size;
+		num_blk = (vers[i]->f_size + BLKSIZE - 1) / BLKSIZE;
+		for (j = 0; j < NDIRECT; j++)
+			v->v_blkn[j] = (j < num_blk) ? vers[i]->f_direct[j] : 0;
+	}
+	r = n;
+out:
+	rwlock_release(&fs_ns, 0);
+	openfile_unlock(d);
+	return r;
+}
+
 // Flush all data and metadata of req->req_fileid to disk.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
@@ -325,10 +977,56 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
+	openfile_enter(o, 0);	// PROJECT
 	file_flush(o->o_file);
+	if (o->o_fatfile) {	// PROJECT: the next write starts a new version
+		flush_block(o->o_fatfile);
+		o->o_newver = 0;
+	}
+	openfile_leave(o, 0);	// PROJECT
+	openfile_unlock(o);	// PROJECT
 	return 0;
 }
 
+// PROJECT: A client is closing the file whose Fd page it sent as the
+// request, which shows that it holds the file.  Flush the file, and if
+// the client was the last to map the page, end the version this open
+// wrote and free the entry.  Others may share the page through fork,
+// spawn or dup, like the CWD_FD a child inherits; closing it in the
+// child leaves it open for them.
+int
+serve_close(envid_t envid, struct Fd *fd)
+{
+	struct OpenFile *o;
+
+	if (debug)
+		cprintf("serve_close %08x %08x\n", envid, fd->fd_file.id);
+
+	o = &opentab[fd->fd_file.id % MAXOPEN];
+	lock_acquire(&o->o_lock);
+	if (o->o_free || o->o_fileid != fd->fd_file.id
+	    || PTE_ADDR(uvpt[PGNUM(fd)]) != PTE_ADDR(uvpt[PGNUM(o->o_fd)])) {
+		lock_release(&o->o_lock);
+		return -E_INVAL;
+	}
+	openfile_enter(o, 0);
+	file_flush(o->o_file);
+
+	// The page is mapped at o_fd, at fd and in the client.
+	if (pageref(o->o_fd) > 3) {
+		openfile_leave(o, 0);
+		lock_release(&o->o_lock);
+		return 0;
+	}
+	if (o->o_fatfile) {	// the next write starts a new version
+		flush_block(o->o_fatfile);
+		o->o_newver = 0;
+	}
+	openfile_leave(o, 0);
+	openfile_free(o);
+	lock_release(&o->o_lock);
+	return 0;
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -337,6 +1035,209 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// PROJECT: Rings of the clients that set one up.
+#define NRINGS		32
+
+struct Ring {
+	envid_t r_envid;	// 0 if the slot is free
+	struct Fsring *r_ring;	// at RINGVA
+	struct Lock r_lock;	// held by the worker serving the ring
+};
+
+struct Ring rings[NRINGS];
+static struct Lock rings_lock;	// for taking a slot
+
+// PROJECT: Make the request page, a struct Fsring, the ring of envid.
+// Its read and write entries use the pages the client granted us.
+int
+serve_ring_setup(envid_t envid, union Fsipc *ipc)
+{
+	struct Ring *free = NULL, *r;
+	int err;
+
+	if (debug)
+		cprintf("serve_ring_setup %08x\n", envid);
+
+	lock_acquire(&rings_lock);
+	for (r = rings; r < rings + NRINGS; r++) {
+		if (r->r_envid == envid)
+			break;
+		if (r->r_envid == 0 && !free)
+			free = r;
+	}
+	if (r == rings + NRINGS && (r = free) == NULL) {
+		lock_release(&rings_lock);
+		return -E_MAX_OPEN;
+	}
+
+	lock_acquire(&r->r_lock);
+	r->r_ring = (struct Fsring *) (RINGVA + (r - rings) * PGSIZE);
+	if ((err = sys_page_map(0, ipc, 0, r->r_ring, PTE_P | PTE_U | PTE_W)) == 0)
+		r->r_envid = envid;
+	lock_release(&r->r_lock);
+	lock_release(&rings_lock);
+	return err;
+}
+
+// PROJECT: Do one submission entry of the ring of envid.
+static int
+ring_do(envid_t envid, struct Fsring_sqe *sqe)
+{
+	struct Fsreq_direct direct;
+	struct Fsreq_flush flush;
+
+	switch (sqe->sqe_op) {
+	case FSRING_READ:
+	case FSRING_WRITE:
+		direct.req_fileid = sqe->sqe_fileid;
+		direct.req_n = sqe->sqe_n;
+		direct.req_buf = sqe->sqe_buf;
+		return serve_direct(envid, &direct, sqe->sqe_op == FSRING_WRITE);
+	case FSRING_FLUSH:
+		flush.req_fileid = sqe->sqe_fileid;
+		return serve_flush(envid, &flush);
+	default:
+		return -E_INVAL;
+	}
+}
+
+// PROJECT: Serve the new entries of every ring but the one of 'skip',
+// as far as there is room for their completions.  Rings whose client
+// is gone are dropped.
+// The client may change its ring page at any time, so each ring gets
+// at most the NRINGENT entries that were submitted when we looked, and
+// a ring whose indices are further apart than that is ignored.
+// A ring another worker is serving is left to it.
+static void
+ring_poll(envid_t skip)
+{
+	struct Ring *r;
+	struct Fsring *ring;
+	struct Fsring_sqe sqe;
+	uint32_t head, tail;
+	int res;
+
+	for (r = rings; r < rings + NRINGS; r++) {
+		if (r->r_envid == 0 || r->r_envid == skip)
+			continue;
+		if (!lock_try(&r->r_lock))
+			continue;
+		if (r->r_envid == 0 || r->r_envid == skip)
+			goto next;
+		ring = r->r_ring;
+		if (pageref(ring) == 1) {
+			sys_page_unmap(0, ring);
+			r->r_envid = 0;
+			goto next;
+		}
+
+		head = ring->sq_head;
+		tail = ring->sq_tail;
+		if (tail - head > NRINGENT)
+			goto next;
+		for (; head != tail && ring->cq_tail - ring->cq_head < NRINGENT; head++) {
+			sqe = ring->sq[head % NRINGENT];
+			res = ring_do(r->r_envid, &sqe);
+			ring->cq[ring->cq_tail % NRINGENT].cqe_res = res;
+			ring->cq[ring->cq_tail % NRINGENT].cqe_user = sqe.sqe_user;
+			ring->sq_head = head + 1;
+			ring->cq_tail++;
+		}
+	next:
+		lock_release(&r->r_lock);
+	}
+}
+
+// PROJECT: Serve the rings now, the one of the caller included, and
+// answer it, so it can sleep in ipc_recv instead of polling its ring.
+// The request page is the caller's ring.
+int
+serve_ring_wait(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_ring_wait %08x\n", envid);
+
+	ring_poll(0);
+	return 0;
+}
+
+// PROJECT: Copy the server's counters to the request page, then clear
+// them if req->req_reset.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	bool reset = ipc->stats.req_reset;
+
+	if (debug)
+		cprintf("serve_stats %08x\n", envid);
+
+	ipc->statsRet.ret_stats = fs_counters;
+	if (reset)
+		memset(&fs_counters, 0, sizeof(fs_counters));
+	return 0;
+}
+
+// PROJECT: Is any version of fatfile ff open?
+static bool
+openfile_busy(struct File *ff)
+{
+	int i;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_fatfile == ff && pageref(opentab[i].o_fd) > 1)
+			return 1;
+	return 0;
+}
+
+// PROJECT: Prune the fatfile of req->req_path with req->req_policy,
+// or make req->req_policy the default policy if the path is empty.
+// A relative path is walked from directory handle req->req_dirid.
+// Returns the number of versions removed, or < 0 on error.
+int
+serve_prune(envid_t envid, struct Fsreq_prune *req)
+{
+	char path[MAXPATHLEN];
+	struct Retention rp;
+	struct File *f, *ff, *at;
+	struct OpenFile *d;
+	struct Walk w = { super->last_ts, WALK_RDONLY };
+	int r;
+
+	if (debug)
+		cprintf("serve_prune %08x %s\n", envid, req->req_path);
+
+	// A relative r_keep_since stays relative in the default policy, so
+	// every background pass keeps a window ending at the last timestamp.
+	rp = req->req_policy;
+	if (req->req_path[0] == '\0') {
+		rwlock_acquire(&fs_ns, 1);
+		retention = rp;
+		rwlock_release(&fs_ns, 1);
+		return 0;
+	}
+	if (rp.r_keep_since < 0)
+		rp.r_keep_since = MAX(super->last_ts + rp.r_keep_since, 1);
+
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	if ((r = dir_handle(envid, req->req_dirid, &at, &d)) < 0)
+		return r;
+	rwlock_acquire(&fs_ns, 1);
+	if ((r = file_open_at(&w, at, path, &f, &ff)) < 0)
+		goto out;
+	if (ff == 0)
+		r = -E_INVAL;
+	else if (openfile_busy(ff))
+		r = -E_BUSY;
+	else
+		r = ff_prune(ff, &rp);
+out:
+	rwlock_release(&fs_ns, 1);
+	openfile_unlock(d);
+	return r;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -347,10 +1248,37 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync // flush the entire file system.
+	[FSREQ_SYNC] =		serve_sync, // flush the entire file system.
+	[FSREQ_PRUNE] =		(fshandler)serve_prune,	// PROJECT
+	[FSREQ_STATS] =		serve_stats,		// PROJECT
+	[FSREQ_READ_DIRECT] =	(fshandler)serve_read_direct,	// PROJECT
+	[FSREQ_WRITE_DIRECT] =	(fshandler)serve_write_direct,	// PROJECT
+	[FSREQ_MAP] =		(fshandler)serve_map,	// PROJECT
+	[FSREQ_RING_SETUP] =	serve_ring_setup,	// PROJECT
+	[FSREQ_READDIR] =	serve_readdir,		// PROJECT
+	[FSREQ_STAT_PATH] =	serve_stat_path,	// PROJECT
+	[FSREQ_LIST_VERSIONS] =	serve_list_versions,	// PROJECT
+	[FSREQ_CHDIR] =		serve_chdir,		// PROJECT
+	[FSREQ_CLOSE] =		(fshandler)serve_close,	// PROJECT
+	[FSREQ_RING_WAIT] =	serve_ring_wait		// PROJECT
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// PROJECT: Count a request of type 'req' that took 'cycles' cycles
+// from its arrival to the reply, in its log2 latency histogram.
+static void
+count_request(uint32_t req, uint64_t cycles)
+{
+	int bucket;
+
+	for (bucket = 0; cycles >> (bucket + 1) && bucket < NLATBUCKETS - 1; bucket++)
+		/* do nothing */;
+
+	fs_counters.st_reqs[req]++;
+	fs_counters.st_cycles[req] += cycles;
+	fs_counters.st_lat[req][bucket]++;
+}
+
 void
 serve(void)
 {
@@ -358,10 +1286,19 @@ serve(void)
 	int perm, r;
 	void *pg;
 	int call_ctr = 0; // Challenge
+	uint64_t start;	// PROJECT
 
 	while (1) {
 		perm = 0;
 		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+
+		// PROJECT: A message from envid 0 is the kernel passing
+		// on a disk interrupt.
+		if (whom == 0) {
+			ide_intr();
+			continue;
+		}
+
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -372,6 +1309,16 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
+		start = read_tsc();	// PROJECT
+
+		// PROJECT: A ring wakeup gets no reply; ring_poll below
+		// posts the completions on the ring.
+		if (req == FSREQ_RING_ENTER) {
+			sys_page_unmap(0, fsreq);
+			ring_poll(0);
+			continue;
+		}
+
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
@@ -381,18 +1328,50 @@ serve(void)
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
+		if (req < NFSREQ)
+			count_request(req, read_tsc() - start);	// PROJECT
 		ipc_send(whom, r, pg, perm);
 		sys_page_unmap(0, fsreq);
+		// PROJECT: serve_open left the new entry locked.
+		if (req == FSREQ_OPEN && r == 0)
+			lock_release(&opentab[((uintptr_t) pg - FILEVA) / PGSIZE].o_lock);
+
+		// PROJECT: Ring entries submitted while we were busy.  The
+		// client we just answered may still have other pages than
+		// its ring's granted to us; it knocks again if it waits.
+		ring_poll(whom);
 
-		// Challenge
+		// PROJECT: Background pruning of old versions, and release
+		// of the blocks clients have unmapped.
 		if(++call_ctr > 1000){
 
-			garbage_collector();	// Implemented in fs/bc.c
+			rwlock_acquire(&fs_ns, 1);
+			fs_prune_pass(openfile_busy);
+			rwlock_release(&fs_ns, 1);
+			mapped_reclaim();
 			call_ctr = 0;
 		}
 	}
 }
 
+// PROJECT: New function.
+// Start NWORKERS - 1 more environments that share our memory, and so
+// the block cache and the open file table, to serve requests with us.
+// Clients spread over them by environment ID.
+static void
+serve_workers(void)
+{
+	int i, r;
+
+	for (i = 1; i < NWORKERS; i++) {
+		if ((r = sfork()) < 0) {
+			cprintf("fs: can't start worker %d: %e\n", i, r);
+			return;
+		}
+		if (r == 0)
+			return;
+	}
+}
 
 void
 umain(int argc, char **argv)
@@ -408,6 +1387,7 @@ umain(int argc, char **argv)
 	serve_init();
 	fs_init();
         fs_test();
+	serve_workers();	// PROJECT
 	serve();
 }
 
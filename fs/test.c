@@ -5,12 +5,213 @@
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
+// PROJECT: Block n of file f, which must be there.
+static uint32_t
+test_block(struct File *f, uint32_t n)
+{
+	if (n < NDIRECT)
+		return f->f_direct[n];
+	assert(n < NDIRECT + NINDIRECT && f->f_indirect);
+	return ((uint32_t*) diskaddr(f->f_indirect))[n - NDIRECT];
+}
+
+// PROJECT: Cleared File records in a block of their own, outside any
+// directory, for checks that must not leave anything behind.  Returns
+// the block; test_release gives it back.
+static int
+test_scratch(struct File **f)
+{
+	int r;
+
+	if ((r = alloc_block()) < 0)
+		panic("alloc_block: %e", r);
+	*f = diskaddr(r);
+	memset(*f, 0, BLKSIZE);
+	strcpy((*f)->f_name, "scratch");
+	return r;
+}
+
+// PROJECT: Free scratch block 'scratch' and write the bitmap out.
+static void
+test_release(int scratch)
+{
+	uint32_t i;
+
+	free_block(scratch);
+	for (i = 0; i < super->s_nblocks; i += BLKBITSIZE)
+		flush_block(&bitmap[i / 32]);
+}
+
+// PROJECT: Check that versions share blocks with reference counts, copy
+// them on write and free them with the last reference.  The file and
+// its fatfile are scratch records, released at the end.
+static void
+check_versions(void)
+{
+	struct File *f, *v, *ff;
+	uint32_t blocks[NDIRECT + 3], ind, vind, vtail, i;
+	size_t size = (NDIRECT + 2) * BLKSIZE + BLKSIZE / 2;
+	char *buf = (char*) (2 * PGSIZE);
+	int r, scratch;
+
+	if (refmap == 0) {
+		cprintf("no reference counts, version checks skipped\n");
+		return;
+	}
+
+	if ((r = sys_page_alloc(0, buf, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	scratch = test_scratch(&f);
+	ff = f + 1;
+	strcpy(ff->f_name, "scratch");
+	ff->f_type = FTYPE_FF | FTYPE_REG;
+
+	// Direct blocks, two whole indirect ones and a partial last block.
+	memset(buf, 'a', PGSIZE);
+	for (i = 0; i * BLKSIZE < size; i++)
+		if ((r = file_write(f, buf, MIN(BLKSIZE, size - i * BLKSIZE), i * BLKSIZE)) < 0)
+			panic("file_write: %e", r);
+	for (i = 0; i < NDIRECT + 3; i++)
+		blocks[i] = test_block(f, i);
+	ind = f->f_indirect;
+
+	v = file_shalldup(ff, f);
+	assert(v->f_size == f->f_size);
+	assert(v->f_indirect == ind && refmap[ind] == 1);
+	for (i = 0; i < NDIRECT; i++)
+		assert(v->f_direct[i] == blocks[i] && refmap[blocks[i]] == 1);
+	cprintf("file_shalldup is good\n");
+
+	// Appending to the version copies the indirect block and the
+	// partial last block it shares; f keeps the originals.
+	if ((r = file_write(v, "b", 1, size)) != 1)
+		panic("file_write: %e", r);
+	vind = v->f_indirect;
+	vtail = test_block(v, NDIRECT + 2);
+	assert(vind != ind && refmap[ind] == 0);
+	assert(vtail != blocks[NDIRECT + 2] && refmap[blocks[NDIRECT + 2]] == 0);
+	assert(test_block(v, NDIRECT) == blocks[NDIRECT] && refmap[blocks[NDIRECT]] == 1);
+	assert(f->f_size == size && test_block(f, NDIRECT + 2) == blocks[NDIRECT + 2]);
+	cprintf("copy-on-write is good\n");
+
+	// Truncating the version frees only what it alone referenced.
+	if ((r = file_set_size(v, 0)) < 0)
+		panic("file_set_size: %e", r);
+	assert(block_is_free(vind) && block_is_free(vtail));
+	assert(!block_is_free(ind));
+	for (i = 0; i < NDIRECT + 3; i++)
+		assert(!block_is_free(blocks[i]) && refmap[blocks[i]] == 0);
+	for (i = 0; i * BLKSIZE < size; i++) {
+		memset(buf, 0, PGSIZE);
+		if ((r = file_read(f, buf, BLKSIZE, i * BLKSIZE)) != MIN(BLKSIZE, size - i * BLKSIZE))
+			panic("file_read: %e", r);
+		while (--r >= 0)
+			assert(buf[r] == 'a');
+	}
+	cprintf("version truncate is good\n");
+
+	// The last reference frees the blocks.
+	if ((r = file_set_size(f, 0)) < 0)
+		panic("file_set_size: %e", r);
+	assert(f->f_indirect == 0 && block_is_free(ind));
+	for (i = 0; i < NDIRECT + 3; i++)
+		assert(block_is_free(blocks[i]));
+	if ((r = file_set_size(ff, 0)) < 0)
+		panic("file_set_size: %e", r);
+	test_release(scratch);
+	sys_page_unmap(0, buf);
+	cprintf("block release is good\n");
+}
+
+// PROJECT: Check that a file grows from its indirect block into the
+// double-indirect one, gives those blocks back when truncated below
+// it, and stays within MAXFILESIZE.  Blocks before the boundary are
+// left as holes.
+static void
+check_dindirect(void)
+{
+	struct File *f;
+	uint32_t last, dind, ind, data;
+	off_t boundary = (NDIRECT + NINDIRECT) * BLKSIZE;
+	char *buf = (char*) (2 * PGSIZE);
+	int r, i, scratch;
+
+	if ((r = sys_page_alloc(0, buf, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	scratch = test_scratch(&f);
+
+	// One write across the boundary.
+	for (i = 0; i < BLKSIZE; i++)
+		buf[i] = i;
+	if ((r = file_write(f, buf, BLKSIZE, boundary - BLKSIZE / 2)) != BLKSIZE)
+		panic("file_write: %e", r);
+	assert(f->f_size == boundary + BLKSIZE / 2);
+	assert(f->f_indirect && f->f_dindirect);
+	last = ((uint32_t*) diskaddr(f->f_indirect))[NINDIRECT - 1];
+	dind = f->f_dindirect;
+	ind = ((uint32_t*) diskaddr(dind))[0];
+	data = ind ? ((uint32_t*) diskaddr(ind))[0] : 0;
+	assert(last && ind && data);
+	assert(!block_is_free(last) && !block_is_free(dind)
+	       && !block_is_free(ind) && !block_is_free(data));
+
+	memset(buf, 0, BLKSIZE);
+	if ((r = file_read(f, buf, BLKSIZE, boundary - BLKSIZE / 2)) != BLKSIZE)
+		panic("file_read: %e", r);
+	for (i = 0; i < BLKSIZE; i++)
+		assert(buf[i] == (char) i);
+	cprintf("double-indirect write is good\n");
+
+	// Everything before the write is a hole, which reads as zeroes
+	// and stays a hole.
+	memset(buf, 0xff, BLKSIZE);
+	if ((r = file_read(f, buf, BLKSIZE, (NDIRECT + 1) * BLKSIZE)) != BLKSIZE)
+		panic("file_read: %e", r);
+	for (i = 0; i < BLKSIZE; i++)
+		assert(buf[i] == 0);
+	assert(((uint32_t*) diskaddr(f->f_indirect))[1] == 0);
+	cprintf("reading a hole is good\n");
+
+	// Truncating to the boundary drops the double-indirect blocks only.
+	if ((r = file_set_size(f, boundary)) < 0)
+		panic("file_set_size: %e", r);
+	assert(f->f_dindirect == 0);
+	assert(block_is_free(dind) && block_is_free(ind) && block_is_free(data));
+	assert(!block_is_free(last));
+	cprintf("double-indirect truncate is good\n");
+
+	// Reading past the indirect block without writing allocates no
+	// double-indirect block.
+	if ((r = file_set_size(f, boundary + 2 * BLKSIZE)) < 0)
+		panic("file_set_size: %e", r);
+	memset(buf, 0xff, BLKSIZE);
+	if ((r = file_read(f, buf, BLKSIZE, boundary + BLKSIZE)) != BLKSIZE)
+		panic("file_read: %e", r);
+	for (i = 0; i < BLKSIZE; i++)
+		assert(buf[i] == 0);
+	assert(f->f_dindirect == 0);
+	if ((r = file_set_size(f, boundary)) < 0)
+		panic("file_set_size: %e", r);
+	cprintf("double-indirect hole is good\n");
+
+	assert(file_set_size(f, MAXFILESIZE + 1) == -E_INVAL);
+	assert(file_write(f, buf, BLKSIZE, MAXFILESIZE - BLKSIZE / 2) == -E_INVAL);
+	assert(f->f_size == boundary);
+
+	if ((r = file_set_size(f, 0)) < 0)
+		panic("file_set_size: %e", r);
+	assert(f->f_indirect == 0 && block_is_free(last));
+	test_release(scratch);
+	sys_page_unmap(0, buf);
+	cprintf("MAXFILESIZE is good\n");
+}
+
 void
 fs_test(void)
 {
 	struct File *f;
 	struct File *ff;	// PROJECT
-	int r;
+	int r, i;
 	char *blk;
 	uint32_t *bits;
 
@@ -28,6 +229,17 @@ fs_test(void)
 	assert(!(bitmap[r/32] & (1 << (r%32))));
 	cprintf("alloc_block is good\n");
 
+	// PROJECT: allocate a contiguous run
+	if ((r = alloc_blocks(4, 0)) < 0)
+		panic("alloc_blocks: %e", r);
+	for (i = r; i < r + 4; i++) {
+		assert(bits[i/32] & (1 << (i%32)));
+		assert(!(bitmap[i/32] & (1 << (i%32))));
+		free_block(i);
+	}
+	flush_block(bitmap);
+	cprintf("alloc_blocks is good\n");
+
 	if ((r = file_open("/not-found", &f, &ff)) < 0 && r != -E_NOT_FOUND)
 		panic("file_open /not-found: %e", r);
 	else if (r == 0)
@@ -65,4 +277,7 @@ fs_test(void)
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file rewrite is good\n");
+
+	check_versions();	// PROJECT
+	check_dindirect();	// PROJECT
 }
@@ -56,6 +56,7 @@ struct Env {
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	envid_t env_vmid;		// PROJECT: first env of its sfork group, 0 if none
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
@@ -66,6 +67,15 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+
+	// PROJECT: Hardware interrupts routed to this env
+	uint32_t env_irq_pending;	// IRQs raised and not yet delivered
+	bool env_irq_waiting;		// Env is blocked in sys_irq_wait
+
+	// PROJECT: Pages another env may map from this one
+	envid_t env_grant_to;		// the env they are granted to, 0 if none
+	uintptr_t env_grant_va;		// first granted page
+	size_t env_grant_npages;	// number of granted pages
 };
 
 #endif // !JOS_INC_ENV_H
@@ -25,6 +25,7 @@ enum {
 	E_FILE_EXISTS	,	// File already exists
 	E_NOT_EXEC	,	// File not a valid executable
 	E_NOT_SUPP	,	// Operation not supported
+	E_BUSY		,	// File is in use	// PROJECT
 
 	MAXERROR
 };
@@ -12,6 +12,10 @@
 #define BLKSIZE		PGSIZE
 #define BLKBITSIZE	(BLKSIZE * 8)
 
+// PROJECT: Maximum disk size the file server can handle (3GB), all of
+// which it maps at once
+#define DISKSIZE	0xC0000000
+
 // Maximum size of a filename (a single path component), including null
 // Must be a multiple of 4
 #define MAXNAMELEN	128
@@ -23,8 +27,13 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// PROJECT: Number of blocks reached through the double-indirect block,
+// which points to NINDIRECT indirect blocks
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// PROJECT: The block map reaches 4GB, beyond what off_t can express,
+// so the limit is the largest block-aligned off_t.
+#define MAXFILESIZE	((off_t) 0x7FFFF000)
 
 typedef ssize_t ts_t;	// PROJECT
 
@@ -42,14 +51,41 @@ struct File {
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
 
+	// PROJECT: Version index of a fat file (FTYPE_FF only).
+	// Versions are appended in timestamp order and records are kept
+	// dense, so the blocks of a fat file form an array sorted by
+	// f_timestamp that ff_lookup can binary search.
+	uint32_t f_nvers;		// number of version records
+
+	// PROJECT: Hashed directory index.
+	// f_hash and f_hnext are kept in every directory entry; f_htree and
+	// f_dfree only mean something for directories.
+	uint32_t f_hash;		// dir_hash(f_name)
+	uint32_t f_hnext;		// next entry slot + 1 in the same bucket
+	uint32_t f_htree;		// hash index block, 0 if not indexed
+	uint32_t f_dfree;		// no free entry slot below this one
+
+	// PROJECT: Block pointers past NDIRECT + NINDIRECT, taken from the
+	// padding so existing records keep their layout.
+	uint32_t f_dindirect;		// double-indirect block
+
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 12 - 4*NDIRECT - 4];	// PROJECT: Changed from -8 to -12
+	uint8_t f_pad[256 - MAXNAMELEN - 12 - 4*NDIRECT - 4 - 4 - 16 - 4];	// PROJECT: Changed from -8 to -12, -4 for f_nvers, -16 for the index, -4 for f_dindirect
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
+// A directory hash index block holds NHASHBUCKETS bucket heads,
+// each the (slot + 1) of the first entry in the bucket.	// PROJECT
+#define NHASHBUCKETS	(BLKSIZE / 4)
+
+// PROJECT: Entry n of the reference count table, which starts at block
+// s_refmap, counts the references to block n beyond the first one,
+// i.e. how many other versions share the block.  0 for free blocks.
+#define NREFPERBLK	(BLKSIZE / 4)
+
 
 // File types
 #define FTYPE_REG	0x00		// Regular file
@@ -66,6 +102,16 @@ struct Super {
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	ts_t last_ts;			// PROJECT: save global timestamp on-disk!
 	struct File s_root;		// Root directory node
+	uint32_t s_refmap;		// PROJECT: first reference count block, 0 if none
+};
+
+// PROJECT: Version retention policy.
+// A version is kept if any rule asks for it; the latest version is
+// always kept.  A policy with no rule set keeps everything.
+struct Retention {
+	uint32_t r_keep_last;	// keep the r_keep_last latest versions
+	ts_t r_keep_since;	// keep versions from this timestamp on (< 0: last_ts + value, 0: unset)
+	bool r_thin;		// keep the latest version of each age range [2^k, 2^(k+1))
 };
 
 // Definitions for requests from clients to file system
@@ -79,7 +125,120 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	FSREQ_PRUNE,	// PROJECT
+	// PROJECT: Stats returns a Fsret_stats on the request page
+	FSREQ_STATS,
+	// PROJECT: Read and write straight from/to the client's pages
+	FSREQ_READ_DIRECT,
+	FSREQ_WRITE_DIRECT,
+	// PROJECT: Map file blocks read-only into the client
+	FSREQ_MAP,
+	// PROJECT: The request page is a struct Fsring to serve from now
+	// on (RING_SETUP), or whose new entries to serve (RING_ENTER, which
+	// gets no reply)
+	FSREQ_RING_SETUP,
+	FSREQ_RING_ENTER,
+	// PROJECT: Readdir returns a Fsret_readdir on the request page
+	FSREQ_READDIR,
+	// PROJECT: Stat a path without opening it (returns a Fsret_stat),
+	// and list the versions of a file (returns a Fsret_versions)
+	FSREQ_STAT_PATH,
+	FSREQ_LIST_VERSIONS,
+	// PROJECT: Repoint a directory handle
+	FSREQ_CHDIR,
+	// PROJECT: Flush and release a file (takes the client's Fd page
+	// as the request)
+	FSREQ_CLOSE,
+	// PROJECT: Like RING_ENTER, but answered once the ring's entries
+	// have been served, so the client can sleep until then
+	FSREQ_RING_WAIT
+};
+
+// PROJECT: One version of a file in a FSREQ_LIST_VERSIONS reply.
+struct Fsversion {
+	ts_t v_ts;
+	off_t v_size;
+	uint32_t v_blkn[NDIRECT];	// its direct blocks
+};
+
+#define NVERSIONS	((PGSIZE - MAXNAMELEN) / sizeof(struct Fsversion))
+
+// PROJECT: One directory entry in a FSREQ_READDIR reply.  Entries are
+// packed one after the other, each d_reclen bytes long.
+struct Fsdirent {
+	uint16_t d_reclen;	// bytes to the next entry, a multiple of 4
+	uint16_t d_type;	// f_type of the entry
+	off_t d_size;		// size of its latest version
+	ts_t d_ts;		// timestamp of its latest version
+	off_t d_ffsize;		// for a fatfile, its own size
+	ts_t d_ffts;		// and its own timestamp
+	char d_name[0];		// NUL terminated
+};
+
+// PROJECT: Most pages one direct read or write request may span.
+#define MAXIOPAGES	64
+
+// PROJECT: File server counters, returned by FSREQ_STATS.
+#define NFSREQ		24	// request codes counted in st_reqs
+#define NLATBUCKETS	32	// st_lat[r][i] counts latencies in [2^i, 2^(i+1)) cycles
+
+struct Fsstats {
+	// Block cache
+	uint32_t st_lookups;		// file blocks looked up
+	uint32_t st_hits;		// lookups that found the block cached
+	uint32_t st_faults;		// block cache page faults
+	uint32_t st_readahead;		// blocks read ahead by those faults
+	uint32_t st_evictions;		// blocks dropped from the cache
+	uint32_t st_flushes;		// blocks written back
+	// Path lookups
+	uint32_t st_dlookups;		// path components looked up
+	uint32_t st_dhits;		// found in the dentry cache
+	// Disk
+	uint32_t st_rcmds;		// read commands
+	uint32_t st_wcmds;		// write commands
+	uint32_t st_rsects;		// sectors read
+	uint32_t st_wsects;		// sectors written
+	// Server
+	uint32_t st_reqs[NFSREQ];	// requests served, by request code
+	uint64_t st_cycles[NFSREQ];	// cycles spent on them
+	uint32_t st_lat[NFSREQ][NLATBUCKETS];	// their latency histograms
+};
+
+// PROJECT: Submission and completion rings shared by a client and the
+// file server in one page.  The client fills submission entries and
+// advances sq_tail; the server takes them at sq_head, does them in
+// order and posts a completion for each at cq_tail; the client takes
+// completions at cq_head.  Counters only grow; entry i is at i % NRINGENT.
+#define NRINGENT	64
+
+enum {
+	FSRING_READ = 1,	// read up to sqe_n bytes into sqe_buf
+	FSRING_WRITE,		// write sqe_n bytes from sqe_buf
+	FSRING_FLUSH		// flush the file
+};
+
+struct Fsring_sqe {
+	uint32_t sqe_op;
+	int sqe_fileid;
+	size_t sqe_n;
+	uintptr_t sqe_buf;	// in the pages granted to the server
+	uint32_t sqe_user;	// copied to the completion
+};
+
+struct Fsring_cqe {
+	int cqe_res;		// what the matching request would return
+	uint32_t cqe_user;
+};
+
+struct Fsring {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	uint32_t sq_prep;	// client only: entries filled, not submitted
+	struct Fsring_sqe sq[NRINGENT];
+	struct Fsring_cqe cq[NRINGENT];
 };
 
 union Fsipc {
@@ -87,6 +246,7 @@ union Fsipc {
 		char req_path[MAXPATHLEN];
 		ts_t req_ts;	// PROJECT
 		int req_omode;
+		int req_dirid;	// PROJECT: relative paths start here, -1: root
 	} open;
 
 	struct Fsreq_set_size {
@@ -121,6 +281,33 @@ union Fsipc {
 		uint32_t ret_blkn[NDIRECT];	// PROJECT
 	} statRet;
 
+	// PROJECT: Point directory handle req_fileid at req_path.
+	struct Fsreq_chdir {
+		int req_fileid;
+		char req_path[MAXPATHLEN];
+	} chdir;
+
+	// PROJECT: Stat req_path as of timestamp req_ts, without
+	// allocating an OpenFile.  Returns a Fsret_stat.
+	struct Fsreq_stat_path {
+		char req_path[MAXPATHLEN];
+		ts_t req_ts;
+		int req_dirid;	// relative paths start here, -1: root
+	} stat_path;
+
+	// PROJECT: List the versions of req_path with timestamp <= req_ts,
+	// newest first and at most NVERSIONS of them.
+	struct Fsreq_versions {
+		char req_path[MAXPATHLEN];
+		ts_t req_ts;
+		int req_dirid;	// relative paths start here, -1: root
+	} versions;
+
+	struct Fsret_versions {
+		char ret_name[MAXNAMELEN];
+		struct Fsversion ret_vers[NVERSIONS];
+	} versionsRet;
+
 	struct Fsreq_flush {
 		int req_fileid;
 	} flush;
@@ -129,6 +316,53 @@ union Fsipc {
 		char req_path[MAXPATHLEN];
 	} remove;
 
+	// PROJECT: Prune the fatfile of req_path now, or with an empty
+	// path make req_policy the policy of the background pruning.
+	struct Fsreq_prune {
+		char req_path[MAXPATHLEN];
+		struct Retention req_policy;
+		int req_dirid;	// relative paths start here, -1: root
+	} prune;
+
+	// PROJECT: Read or write req_n bytes at req_buf in the client,
+	// whose pages the client has granted to the server with
+	// sys_page_grant.  The buffer may span at most MAXIOPAGES pages.
+	struct Fsreq_direct {
+		int req_fileid;
+		size_t req_n;
+		uintptr_t req_buf;
+	} direct;
+
+	// PROJECT: Map the blocks of the req_npages pages of the file from
+	// req_offset (page-aligned) on at req_va in the client, which has
+	// granted those pages to the server.  The blocks stay allocated
+	// until the client unmaps them.
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+		uint32_t req_npages;
+		uintptr_t req_va;
+	} map;
+
+	// PROJECT: Pack the entries of directory req_fileid from its seek
+	// position on into ret_buf, as many as fit, and advance it.
+	struct Fsreq_readdir {
+		int req_fileid;
+	} readdir;
+
+	struct Fsret_readdir {
+		char ret_buf[PGSIZE];
+	} readdirRet;
+
+	// PROJECT: Return the counters, then clear them if req_reset.
+	struct Fsreq_stats {
+		bool req_reset;
+	} stats;
+
+	struct Fsret_stats {
+		struct Fsstats ret_stats;
+	} statsRet;
+
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
 };
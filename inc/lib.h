@@ -28,6 +28,9 @@ void	umain(int argc, char **argv);
 
 // SHELL-PATH address
 #define PATH_VA		((void*) 0xB0000000)	// PROJECT
+// PROJECT: The shell's working directory handle, shared with its children.
+// Relative paths opened at it skip walking the PATH prefix.
+#define CWD_FD		31
 
 #define TS_UNSPECIFIED	MAX_SSIZE	// PROJECT
 
@@ -35,6 +38,7 @@ void	umain(int argc, char **argv);
 // libmain.c or entry.S
 extern const char *binaryname;
 extern const volatile struct Env *thisenv;
+extern bool sforked;	// PROJECT: thisenv may be shared, see sfork
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
@@ -62,6 +66,11 @@ int		sys_page_map(envid_t src_env, void *src_pg, envid_t dst_env, void *dst_pg,
 int		sys_page_unmap(envid_t env, void *pg);
 int		sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int		sys_ipc_recv(void *rcv_pg);
+int		sys_irq_listen(int irq);	// PROJECT
+int		sys_irq_wait(void);		// PROJECT
+int		sys_page_grant(envid_t env, void *va, size_t npages);	// PROJECT
+int		sys_env_share_vm(envid_t env);	// PROJECT
+int		sys_page_clear(void *va, int bits);	// PROJECT
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -96,7 +105,7 @@ ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
-int	stat_ts(const char *path, struct Stat *stat, ts_t req_ts);	// PROJECT
+int	stat_ts(int dirfd, const char *path, struct Stat *stat, ts_t req_ts);	// PROJECT
 
 // file.c
 int	open(const char *path, int mode);
@@ -104,6 +113,21 @@ int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
 int	open_ts(const char *path, int mode, ts_t req_ts);	// PROJECT
+int	openat(int dirfd, const char *path, int mode);	// PROJECT
+int	openat_ts(int dirfd, const char *path, int mode, ts_t req_ts);	// PROJECT
+int	fchdir(int dirfd, const char *path);	// PROJECT
+int	prune(int dirfd, const char *path, const struct Retention *rp);	// PROJECT
+int	set_retention(const struct Retention *rp);	// PROJECT
+int	fsstats(struct Fsstats *st, bool reset);	// PROJECT
+int	readdir(int fdnum, void *buf);	// PROJECT
+int	list_versions(int dirfd, const char *path, ts_t req_ts, char *name, struct Fsversion *vers);	// PROJECT
+int	mmap(void *va, size_t len, int fdnum, off_t offset);	// PROJECT
+void	munmap(void *va, size_t len);	// PROJECT
+int	read_map(int fdnum, off_t offset, void **blk);	// PROJECT
+int	ring_setup(struct Fsring *ring, void *buf, size_t npages);	// PROJECT
+int	ring_prep(struct Fsring *ring, uint32_t op, int fdnum, void *buf, size_t n, uint32_t user);	// PROJECT
+int	ring_submit(struct Fsring *ring);	// PROJECT
+void	ring_wait(struct Fsring *ring, struct Fsring_cqe *cqe);	// PROJECT
 
 // pageref.c
 int	pageref(void *addr);
@@ -126,6 +126,9 @@
 // Next page left invalid to guard against exception stack overflow; then:
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
+// PROJECT: Environments made by sfork share every page table below UTOP
+// but the one for [UPRIVATE, UTOP), which holds their stacks.
+#define UPRIVATE	(UTOP - PTSIZE)
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
@@ -17,6 +17,11 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_irq_listen,		// PROJECT
+	SYS_irq_wait,		// PROJECT
+	SYS_page_grant,		// PROJECT
+	SYS_env_share_vm,	// PROJECT
+	SYS_page_clear,		// PROJECT
 	NSYSCALLS
 };
 
@@ -34,6 +34,7 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint32_t bsf(uint32_t word) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void)
@@ -280,6 +281,15 @@ read_tsc(void)
 	return tsc;
 }
 
+// Index of the least significant set bit in word; word must be non-zero.
+static __inline uint32_t
+bsf(uint32_t word)
+{
+	uint32_t index;
+	__asm __volatile("bsfl %1,%0" : "=r" (index) : "rm" (word) : "cc");
+	return index;
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -293,4 +303,18 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// PROJECT: Store newval at addr if it holds oldval.  Returns what addr
+// held, so the store happened iff that equals oldval.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (oldval) :
+			"cc");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -108,6 +108,57 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// PROJECT: Make env 'e' share the address space of env 'from' below
+// UPRIVATE: e gets from's page tables, and both see every page mapped
+// there by either of them later on.  [UPRIVATE, UTOP) stays e's own.
+// e must not have mapped anything below UTOP yet.
+// Returns -E_INVAL if it has.
+int
+env_share_vm(struct Env *from, struct Env *e)
+{
+	uint32_t pdeno;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++)
+		if (e->env_pgdir[pdeno] & PTE_P)
+			return -E_INVAL;
+
+	if (!from->env_vmid)
+		from->env_vmid = from->env_id;
+	e->env_vmid = from->env_vmid;
+	e->env_type = from->env_type;
+	for (pdeno = 0; pdeno < PDX(UPRIVATE); pdeno++)
+		if (from->env_pgdir[pdeno] & PTE_P) {
+			e->env_pgdir[pdeno] = from->env_pgdir[pdeno];
+			pa2page(PTE_ADDR(from->env_pgdir[pdeno]))->pp_ref++;
+		}
+	return 0;
+}
+
+// PROJECT: pgdir has just got a page table for 'va'.  If it belongs to
+// an env sharing its address space, give the page table to the others.
+void
+env_share_pt(pde_t *pgdir, const void *va)
+{
+	struct Env *e, *o;
+	pde_t pde = pgdir[PDX(va)];
+
+	if ((uintptr_t) va >= UPRIVATE)
+		return;
+	for (e = envs; e < envs + NENV; e++)
+		if (e->env_status != ENV_FREE && e->env_pgdir == pgdir)
+			break;
+	if (e == envs + NENV || !e->env_vmid)
+		return;
+
+	for (o = envs; o < envs + NENV; o++)
+		if (o != e && o->env_status != ENV_FREE
+		    && o->env_vmid == e->env_vmid
+		    && !(o->env_pgdir[PDX(va)] & PTE_P)) {
+			o->env_pgdir[PDX(va)] = pde;
+			pa2page(PTE_ADDR(pde))->pp_ref++;
+		}
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -281,6 +332,12 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// PROJECT: No interrupts are waiting for a new env.
+	e->env_irq_pending = 0;
+	e->env_irq_waiting = 0;
+	e->env_grant_to = 0;
+	e->env_vmid = 0;
+
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
@@ -488,6 +545,13 @@ env_free(struct Env *e)
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
+		// PROJECT: Envs sharing our address space still use it.
+		if (pa2page(pa)->pp_ref > 1) {
+			e->env_pgdir[pdeno] = 0;
+			page_decref(pa2page(pa));
+			continue;
+		}
+
 		// unmap all PTEs in this page table
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_P)
@@ -546,6 +610,8 @@ env_pop_tf(struct Trapframe *tf)
 {
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
+	// PROJECT: From here on TLB shootdowns must interrupt us.
+	thiscpu->cpu_in_user = 1;
 
 	unlock_kernel();
 
@@ -18,6 +18,8 @@ void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	env_share_vm(struct Env *from, struct Env *e);	// PROJECT
+void	env_share_pt(pde_t *pgdir, const void *va);	// PROJECT
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -67,6 +67,7 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void tlb_shootdown(pde_t pde, void *va);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -473,6 +474,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 		new_page->pp_ref++;
 		
 		*pde_entry = page2pa(new_page) | PTE_P | PTE_W | PTE_U;
+
+		// PROJECT: Let the envs sharing this address space see it.
+		if (pgdir != kern_pgdir && (uintptr_t) va < UTOP)
+			env_share_pt(pgdir, va);
 	}
 
 	pgtbl = (pte_t*)KADDR(PTE_ADDR(*pde_entry));
@@ -648,9 +653,47 @@ page_remove(pde_t *pgdir, void *va)
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	pde_t pde = pgdir[PDX(va)];
+
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	// PROJECT: Or a page table it shares with pgdir (see sfork), which
+	// other CPUs may be using too.
+	if (!curenv || curenv->env_pgdir == pgdir
+	    || curenv->env_pgdir[PDX(va)] == pde)
 		invlpg(va);
+	if ((uintptr_t) va < UTOP && (pde & PTE_P)
+	    && pa2page(PTE_ADDR(pde))->pp_ref > 1)
+		tlb_shootdown(pde, va);
+}
+
+// PROJECT: Bumped by each TLB shootdown.  A CPU is done with a shootdown
+// once its cpu_tlb_gen has caught up.
+volatile uint32_t tlb_gen;
+
+// PROJECT: Make the other CPUs running an env that maps va through the
+// page table in 'pde' flush their TLBs, and wait until they have.  A CPU
+// in the kernel is not interrupted: it flushes in trap() once it has the
+// kernel lock, which we hold.
+static void
+tlb_shootdown(pde_t pde, void *va)
+{
+	struct CpuInfo *c;
+	uint32_t gen;
+
+	// xchg orders our PTE updates before the cpu_in_user reads below.
+	gen = tlb_gen + 1;
+	xchg(&tlb_gen, gen);
+	thiscpu->cpu_tlb_gen = gen;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_in_user && c->cpu_env
+		    && c->cpu_env->env_pgdir[PDX(va)] == pde)
+			lapic_ipi_to(c->cpu_id, T_TLBFLUSH);
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c != thiscpu && c->cpu_in_user
+		       && (int32_t) (c->cpu_tlb_gen - gen) < 0
+		       && c->cpu_env && c->cpu_env->env_pgdir[PDX(va)] == pde)
+			asm volatile("pause");
 }
 
 //
@@ -62,6 +62,7 @@ struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+extern volatile uint32_t tlb_gen;	// PROJECT
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -235,6 +235,23 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return -E_NO_MEM;
 }
 
+// PROJECT: Has 'e' granted the page at va to the current env, or to an
+// env sharing its address space (see sfork)?
+static bool
+page_granted(struct Env *e, void *va)
+{
+	struct Env *g;
+
+	if (e->env_grant_to == 0)
+		return false;
+	if (e->env_grant_to != curenv->env_id
+	    && (!curenv->env_vmid || envid2env(e->env_grant_to, &g, 0) < 0
+		|| g->env_vmid != curenv->env_vmid))
+		return false;
+	return (uintptr_t) va >= e->env_grant_va
+		&& (uintptr_t) va < e->env_grant_va + e->env_grant_npages * PGSIZE;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -283,10 +300,14 @@ sys_page_map(envid_t srcenvid, void *srcva,
                 // no other bits are allowed to set
                 return -E_INVAL;
 
-        if(envid2env(srcenvid, &srcenv, check_perm) < 0)
+        // PROJECT: Pages granted to the caller with sys_page_grant
+        // may be mapped from and to an env the caller has no rights on.
+        if(envid2env(srcenvid, &srcenv, check_perm) < 0
+           && (envid2env(srcenvid, &srcenv, 0) < 0 || !page_granted(srcenv, srcva)))
                 return -E_BAD_ENV;
 
-        if(envid2env(dstenvid, &dstenv, check_perm) < 0)
+        if(envid2env(dstenvid, &dstenv, check_perm) < 0
+           && (envid2env(dstenvid, &dstenv, 0) < 0 || !page_granted(dstenv, dstva)))
                 return -E_BAD_ENV;
 
         if(!(pp = page_lookup(srcenv->env_pgdir, srcva, &src_pte)))
@@ -443,6 +464,16 @@ sys_ipc_recv(void *dstva)
 	if((uint32_t)dstva < UTOP && (uint32_t)dstva % PGSIZE)
 		return -E_INVAL;
 
+	// PROJECT: Interrupts that came in meanwhile are received
+	// as a message from envid 0.
+	if (curenv->env_irq_pending) {
+		curenv->env_ipc_from = 0;
+		curenv->env_ipc_value = curenv->env_irq_pending;
+		curenv->env_ipc_perm = 0;
+		curenv->env_irq_pending = 0;
+		return 0;
+	}
+
 	curenv->env_ipc_recving = true;
 	curenv->env_ipc_dstva = dstva;
 
@@ -453,6 +484,112 @@ sys_ipc_recv(void *dstva)
 	return 0;
 }
 
+// PROJECT: Let env 'envid' use sys_page_map on the 'npages' pages from
+// 'va' on in the current env's address space, as if it were our
+// parent: it may map those pages into its own space, or map its pages
+// there.  The grant lasts until the next call; npages == 0 revokes it.
+// The pages keep their own permissions: a read-only page cannot be
+// mapped writable.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_INVAL if va is not page-aligned or the range reaches UTOP.
+static int
+sys_page_grant(envid_t envid, void *va, size_t npages)
+{
+	struct Env *e;
+
+	if (npages == 0) {
+		curenv->env_grant_to = 0;
+		return 0;
+	}
+	if ((uintptr_t) va % PGSIZE || (uintptr_t) va >= UTOP
+	    || npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	if (envid2env(envid, &e, 0) < 0)
+		return -E_BAD_ENV;
+
+	curenv->env_grant_to = e->env_id;
+	curenv->env_grant_va = (uintptr_t) va;
+	curenv->env_grant_npages = npages;
+	return 0;
+}
+
+// PROJECT: Route hardware interrupt 'irq' to the current environment.
+// It is then received like an IPC from envid 0 whose value has bit
+// 'irq' set, or through sys_irq_wait.
+// Returns 0 on success, < 0 on error (see irq_listen).
+static int
+sys_irq_listen(int irq)
+{
+	return irq_listen(curenv, irq);
+}
+
+// PROJECT: Block until one of the interrupts routed to the current
+// environment is raised, without receiving IPC meanwhile.
+// Returns the bit mask of the IRQs raised.
+static int
+sys_irq_wait(void)
+{
+	uint32_t pending;
+
+	if ((pending = curenv->env_irq_pending) != 0) {
+		curenv->env_irq_pending = 0;
+		return pending;
+	}
+
+	curenv->env_irq_waiting = true;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
+// PROJECT: Make the child 'envid', which has nothing mapped below UTOP
+// yet, share the current env's address space except [UPRIVATE, UTOP).
+// See sfork.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if envid is not a child of the current env.
+//	-E_INVAL if envid has pages mapped already.
+static int
+sys_env_share_vm(envid_t envid)
+{
+	struct Env *e;
+
+	if (envid2env(envid, &e, 1) < 0 || e == curenv)
+		return -E_BAD_ENV;
+	return env_share_vm(curenv, e);
+}
+
+// PROJECT: Atomically clear 'bits', some of PTE_A, PTE_D and PTE_P, in
+// the PTE of the page at 'va' in the current env.  Clearing PTE_P
+// unmaps the page.  Envs sharing the page table (see sfork) cannot set
+// the bits again through their TLBs once this returns.
+//
+// Returns the PTE_A and PTE_D bits the page had, 0 if it was not mapped,
+// or -E_INVAL if va >= UTOP, va is not page-aligned or bits is wrong.
+static int
+sys_page_clear(void *va, int bits)
+{
+	struct PageInfo *pp;
+	pte_t *pte, old;
+
+	if ((uintptr_t) va >= UTOP || (uintptr_t) va % PGSIZE
+	    || (bits & ~(PTE_A | PTE_D | PTE_P)))
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pgdir, va, &pte)))
+		return 0;
+
+	if (bits & PTE_P) {
+		old = xchg(pte, 0);
+		page_decref(pp);
+	} else
+		do
+			old = *pte;
+		while (cmpxchg(pte, old, old & ~bits) != old);
+	tlb_invalidate(curenv->env_pgdir, va);
+	return old & (PTE_A | PTE_D);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -507,6 +644,21 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_env_set_trapframe:
 			return sys_env_set_trapframe((envid_t)a1, (void*)a2);
 
+		case SYS_irq_listen:	// PROJECT
+			return sys_irq_listen((int)a1);
+
+		case SYS_irq_wait:	// PROJECT
+			return sys_irq_wait();
+
+		case SYS_page_grant:	// PROJECT
+			return sys_page_grant((envid_t)a1, (void*)a2, (size_t)a3);
+
+		case SYS_env_share_vm:	// PROJECT
+			return sys_env_share_vm((envid_t)a1);
+
+		case SYS_page_clear:	// PROJECT
+			return sys_page_clear((void*)a1, (int)a2);
+
 		default:
 			return -E_INVAL;
 	}
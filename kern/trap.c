@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -16,6 +17,9 @@
 
 static struct Taskstate ts;
 
+// PROJECT: The env each IRQ is routed to, 0 if the kernel handles it.
+static envid_t irq_env[MAX_IRQS];
+
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
  * additional information in the latter case.
@@ -178,6 +182,74 @@ print_regs(struct PushRegs *regs)
 	cprintf("  eax  0x%08x\n", regs->reg_eax);
 }
 
+// PROJECT: Route IRQ 'irq' to environment 'e' and unmask it.
+// Only the file system server may drive devices, and only on lines
+// the kernel does not use itself.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if e is not the file system server.
+//	-E_INVAL if irq is not a line an environment can have.
+int
+irq_listen(struct Env *e, int irq)
+{
+	if (e->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	if (irq < 0 || irq >= MAX_IRQS || irq == IRQ_TIMER || irq == IRQ_KBD
+	    || irq == IRQ_SERIAL || irq == IRQ_SLAVE || irq == IRQ_SPURIOUS)
+		return -E_INVAL;
+
+	irq_env[irq] = e->env_id;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	return 0;
+}
+
+// PROJECT: Raise IRQ 'irq' in env e.  If e is blocked in sys_irq_wait,
+// or in sys_ipc_recv and 'recv' is set, it is woken up right away;
+// otherwise the IRQ stays pending until it asks for it.
+static void
+irq_raise(struct Env *e, int irq, bool recv)
+{
+	e->env_irq_pending |= 1 << irq;
+	if (e->env_ipc_recving && recv) {
+		e->env_ipc_recving = false;
+		e->env_ipc_from = 0;
+		e->env_ipc_value = e->env_irq_pending;
+		e->env_ipc_perm = 0;
+		e->env_tf.tf_regs.reg_eax = 0;
+	} else if (e->env_irq_waiting) {
+		e->env_irq_waiting = false;
+		e->env_tf.tf_regs.reg_eax = e->env_irq_pending;
+	} else
+		return;
+	e->env_irq_pending = 0;
+	e->env_status = ENV_RUNNABLE;
+}
+
+// PROJECT: Hand IRQ 'irq' to the env listening to it.  Envs sharing its
+// address space (see sfork) drive the same device, so the IRQ is raised
+// in them too, but only the listener is woken from sys_ipc_recv.
+static void
+irq_deliver(int irq)
+{
+	struct Env *e, *o;
+
+	// The slave PIC does not do automatic EOI.
+	if (irq >= 8)
+		outb(IO_PIC2, 0x20);
+
+	if (envid2env(irq_env[irq], &e, 0) < 0) {
+		irq_env[irq] = 0;
+		irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+		return;
+	}
+
+	irq_raise(e, irq, true);
+	if (e->env_vmid)
+		for (o = envs; o < envs + NENV; o++)
+			if (o != e && o->env_status != ENV_FREE
+			    && o->env_vmid == e->env_vmid)
+				irq_raise(o, irq, false);
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -239,6 +311,13 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// PROJECT: Interrupts of devices driven by an environment.
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS
+	    && irq_env[tf->tf_trapno - IRQ_OFFSET]) {
+		irq_deliver(tf->tf_trapno - IRQ_OFFSET);
+		return;
+	}
+
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT)
@@ -249,6 +328,21 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+// PROJECT: Return to the code 'tf' was saved from, kernel or user,
+// without the kernel lock (see env_pop_tf).
+static void __attribute__((noreturn))
+trap_return(struct Trapframe *tf)
+{
+	asm volatile("movl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+		"\tiret"
+		: : "g" (tf) : "memory");
+	panic("iret failed");
+}
+
 void
 trap(struct Trapframe *tf)
 {
@@ -261,6 +355,15 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// PROJECT: A TLB shootdown (see tlb_shootdown).  The CPU sending it
+	// holds the kernel lock and waits for us, so flush without it.
+	if (tf->tf_trapno == T_TLBFLUSH) {
+		lcr3(rcr3());
+		thiscpu->cpu_tlb_gen = tlb_gen;
+		lapic_eoi();
+		trap_return(tf);
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -277,8 +380,16 @@ trap(struct Trapframe *tf)
 		// LAB 4: Your code here.
 		assert(curenv);
 
+		thiscpu->cpu_in_user = 0;
 		lock_kernel();
 
+		// PROJECT: Catch up with shootdowns sent while we were
+		// getting here.
+		if (thiscpu->cpu_tlb_gen != tlb_gen) {
+			lcr3(rcr3());
+			thiscpu->cpu_tlb_gen = tlb_gen;
+		}
+
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
 			env_free(curenv);
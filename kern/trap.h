@@ -19,5 +19,7 @@ void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
 void backtrace(struct Trapframe *);
+struct Env;
+int irq_listen(struct Env *e, int irq);	// PROJECT
 
 #endif /* JOS_KERN_TRAP_H */
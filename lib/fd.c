@@ -312,21 +312,9 @@ fstat(int fdnum, struct Stat *stat)
 	return (*dev->dev_stat)(fd, stat);
 }
 
-int
-stat_ts(const char *path, struct Stat *stat, ts_t req_ts)
-{
-	int fd, r;
-
-	if ((fd = open_ts(path, O_RDONLY, req_ts)) < 0)
-		return fd;
-	r = fstat(fd, stat);
-	close(fd);
-	return r;
-}
-
 int
 stat(const char *path, struct Stat *stat)	// PROJECT
 {
-	return stat_ts(path, stat, TS_UNSPECIFIED);
+	return stat_ts(-1, path, stat, TS_UNSPECIFIED);
 }
 
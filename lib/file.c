@@ -6,6 +6,46 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t fsenv;	// PROJECT: file scope for devfile_direct
+
+// PROJECT: The buffer pages a ring has granted to the file server for
+// good, if any.  Requests that grant other pages for a moment put this
+// grant back afterwards.
+static void *ring_buf;
+static size_t ring_npages;
+
+// PROJECT: The file server runs several workers, all of type
+// ENV_TYPE_FS.  Each env sends its requests to one of them, picked by
+// its env index so that clients spread over the workers; a forked child
+// picks again.  Returns 0 if there is no file server.
+static envid_t
+fs_env(void)
+{
+	static envid_t picked_for;
+	int i, n;
+
+	if (fsenv && picked_for == thisenv->env_id)
+		return fsenv;
+	for (i = n = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_FS && envs[i].env_status != ENV_FREE)
+			n++;
+	if (n == 0)
+		return 0;
+	picked_for = thisenv->env_id;
+	n = ENVX(thisenv->env_id) % n;
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_FS && envs[i].env_status != ENV_FREE
+		    && n-- == 0)
+			break;
+	return envs[i].env_id;
+}
+
+static void
+grant_restore(void)
+{
+	sys_page_grant(fsenv, ring_buf, ring_npages);
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,9 +55,7 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
+	fsenv = fs_env();
 
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
@@ -28,7 +66,7 @@ fsipc(unsigned type, void *dstva)
 	return ipc_recv(NULL, dstva, NULL);
 }
 
-static int devfile_flush(struct Fd *fd);
+static int devfile_close(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
@@ -39,7 +77,7 @@ struct Dev devfile =
 	.dev_id =	'f',
 	.dev_name =	"file",
 	.dev_read =	devfile_read,
-	.dev_close =	devfile_flush,
+	.dev_close =	devfile_close,
 	.dev_stat =	devfile_stat,
 	.dev_write =	devfile_write,
 	.dev_trunc =	devfile_trunc
@@ -72,6 +110,42 @@ open(const char *path, int mode)
 
 int
 open_ts(const char *path, int mode, ts_t req_ts)	// PROJECT
+{
+	return openat_ts(-1, path, mode, req_ts);
+}
+
+// PROJECT: New function.
+// Set *dirid to the file server's handle for directory 'dirfd', which
+// a relative 'path' is walked from, or to -1 for the root.
+static int
+dir_id(int dirfd, const char *path, int *dirid)
+{
+	struct Fd *dir;
+	int r;
+
+	*dirid = -1;
+	if (dirfd == -1 || path[0] == '/')
+		return 0;
+	if ((r = fd_lookup(dirfd, &dir)) < 0)
+		return r;
+	if (dir->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	*dirid = dir->fd_file.id;
+	return 0;
+}
+
+// PROJECT: Open 'path' like open(), but if it is relative the file
+// server walks it from directory 'dirfd' rather than from the root.
+int
+openat(int dirfd, const char *path, int mode)
+{
+	return openat_ts(dirfd, path, mode, TS_UNSPECIFIED);
+}
+
+// PROJECT: openat as of timestamp 'req_ts'.  A 'dirfd' of -1 stands
+// for the root.
+int
+openat_ts(int dirfd, const char *path, int mode, ts_t req_ts)
 {
 	int r;
 	struct Fd *fd;
@@ -79,6 +153,9 @@ open_ts(const char *path, int mode, ts_t req_ts)	// PROJECT
 	if (strlen(path) >= MAXPATHLEN)
 		return -E_BAD_PATH;
 
+	if ((r = dir_id(dirfd, path, &fsipcbuf.open.req_dirid)) < 0)
+		return r;
+
 	if ((r = fd_alloc(&fd)) < 0)
 		return r;
 
@@ -93,19 +170,129 @@ open_ts(const char *path, int mode, ts_t req_ts)	// PROJECT
 	return fd2num(fd);
 }
 
+// PROJECT: Point directory handle 'dirfd' at 'path', relative to the
+// directory it stands for now.  The change is seen through every copy
+// of the handle, in this environment or another.
+int
+fchdir(int dirfd, const char *path)
+{
+	int r;
+	struct Fd *fd;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	if ((r = fd_lookup(dirfd, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	fsipcbuf.chdir.req_fileid = fd->fd_file.id;
+	strcpy(fsipcbuf.chdir.req_path, path);
+	return fsipc(FSREQ_CHDIR, NULL);
+}
+
+// PROJECT: Stat 'path' as of timestamp 'req_ts' with a single
+// FSREQ_STAT_PATH request, rather than an open, fstat and close.
+// A relative path starts at directory 'dirfd' like in openat.
+int
+stat_ts(int dirfd, const char *path, struct Stat *st, ts_t req_ts)
+{
+	int r, i;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	if ((r = dir_id(dirfd, path, &fsipcbuf.stat_path.req_dirid)) < 0)
+		return r;
+
+	strcpy(fsipcbuf.stat_path.req_path, path);
+	fsipcbuf.stat_path.req_ts = req_ts;
+	if ((r = fsipc(FSREQ_STAT_PATH, NULL)) < 0)
+		return r;
+	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
+	st->st_size = fsipcbuf.statRet.ret_size;
+	st->st_ftype = fsipcbuf.statRet.ret_ftype;
+	st->st_ts = fsipcbuf.statRet.ret_ts;
+	for(i = 0; i < NDIRECT; ++i)
+		st->st_blkn[i] = fsipcbuf.statRet.ret_blkn[i];
+	st->st_dev = &devfile;
+	return 0;
+}
+
+// PROJECT: Store in 'vers' (NVERSIONS entries) the versions of 'path'
+// with timestamp <= 'req_ts', newest first, and the file's name in
+// 'name' (MAXNAMELEN bytes) if it is not NULL.  A relative path starts
+// at directory 'dirfd'.  Returns the number of versions stored, 0 when
+// there are none left, or < 0 on error.
+int
+list_versions(int dirfd, const char *path, ts_t req_ts, char *name, struct Fsversion *vers)
+{
+	int r;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	if ((r = dir_id(dirfd, path, &fsipcbuf.versions.req_dirid)) < 0)
+		return r;
+
+	strcpy(fsipcbuf.versions.req_path, path);
+	fsipcbuf.versions.req_ts = req_ts;
+	if ((r = fsipc(FSREQ_LIST_VERSIONS, NULL)) <= 0)
+		return r;
+	if (name)
+		strcpy(name, fsipcbuf.versionsRet.ret_name);
+	memmove(vers, fsipcbuf.versionsRet.ret_vers, r * sizeof(struct Fsversion));
+	return r;
+}
+
 // Flush the file descriptor.  After this the fileid is invalid.
 //
-// This function is called by fd_close.  fd_close will take care of
-// unmapping the FD page from this environment.  Since the server uses
-// the reference counts on the FD pages to detect which files are
-// open, unmapping it is enough to free up server-side resources.
-// Other than that, we just have to make sure our changes are flushed
-// to disk.
+// This function is called by fd_close.
+// PROJECT: The FD page itself is the request, which shows the server
+// that we hold the file; fd_close unmaps it afterwards.  If this was
+// the last environment mapping it, the server frees the open file entry
+// right away instead of finding it unreferenced on a later scan.
 static int
-devfile_flush(struct Fd *fd)
+devfile_close(struct Fd *fd)
+{
+	fsenv = fs_env();
+
+	ipc_send(fsenv, FSREQ_CLOSE, fd, PTE_P | PTE_U);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+// PROJECT: Read (type FSREQ_READ_DIRECT) or write (FSREQ_WRITE_DIRECT)
+// up to MAXIOPAGES pages of 'buf' in one request.  The pages are
+// granted to the file server, which maps them and moves the bytes
+// itself, so they don't go through fsipcbuf.
+//
+// Returns the number of bytes moved, or < 0 on error.
+static ssize_t
+devfile_direct(struct Fd *fd, void *buf, size_t n, int type)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	uintptr_t va, start = ROUNDDOWN((uintptr_t) buf, PGSIZE);
+	int r;
+
+	n = MIN(n, MAXIOPAGES * PGSIZE - PGOFF(buf));
+
+	// The pages must be present, and private to us if the server is
+	// going to write them: touching them resolves copy-on-write.
+	for (va = start; va < (uintptr_t) buf + n; va += PGSIZE)
+		if (type == FSREQ_READ_DIRECT)
+			*(volatile char *) va = *(volatile char *) va;
+		else
+			(void) *(volatile char *) va;
+
+	fsenv = fs_env();
+	if ((r = sys_page_grant(fsenv, (void *) start,
+				(ROUNDUP((uintptr_t) buf + n, PGSIZE) - start) / PGSIZE)) < 0)
+		return r;
+
+	fsipcbuf.direct.req_fileid = fd->fd_file.id;
+	fsipcbuf.direct.req_n = n;
+	fsipcbuf.direct.req_buf = (uintptr_t) buf;
+	r = fsipc(type, NULL);
+
+	grant_restore();
+	return r;
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -122,6 +309,9 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	if (n > PGSIZE)		// PROJECT
+		return devfile_direct(fd, buf, n, FSREQ_READ_DIRECT);
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -148,6 +338,9 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// LAB 5: Your code here
 	size_t size_to_write;
 
+	if (n > sizeof(fsipcbuf.write.req_buf))	// PROJECT
+		return devfile_direct(fd, (void *) buf, n, FSREQ_WRITE_DIRECT);
+
 	size_to_write = MIN(n, sizeof(fsipcbuf.write.req_buf));
 
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
@@ -185,6 +378,228 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 }
 
 
+// PROJECT: Remove the versions of 'path' that policy 'rp' does not keep.
+// A relative path starts at directory 'dirfd'.
+// Returns the number of versions removed, < 0 on error.
+int
+prune(int dirfd, const char *path, const struct Retention *rp)
+{
+	int r;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	if ((r = dir_id(dirfd, path, &fsipcbuf.prune.req_dirid)) < 0)
+		return r;
+	strcpy(fsipcbuf.prune.req_path, path);
+	fsipcbuf.prune.req_policy = *rp;
+	return fsipc(FSREQ_PRUNE, NULL);
+}
+
+// PROJECT: Make 'rp' the policy the file server prunes fatfiles with
+// in the background.
+int
+set_retention(const struct Retention *rp)
+{
+	fsipcbuf.prune.req_path[0] = '\0';
+	fsipcbuf.prune.req_policy = *rp;
+	fsipcbuf.prune.req_dirid = -1;
+	return fsipc(FSREQ_PRUNE, NULL);
+}
+
+// PROJECT: Get the file server's counters in *st, and clear them
+// on the server if 'reset'.
+int
+fsstats(struct Fsstats *st, bool reset)
+{
+	int r;
+
+	fsipcbuf.stats.req_reset = reset;
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet.ret_stats;
+	return 0;
+}
+
+// PROJECT: Read the next entries of directory 'fdnum' into 'buf',
+// which must hold PGSIZE bytes, as packed struct Fsdirents.
+// Returns the number of bytes filled, 0 at the end of the directory,
+// or < 0 on error.
+int
+readdir(int fdnum, void *buf)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	fsipcbuf.readdir.req_fileid = fd->fd_file.id;
+	if ((r = fsipc(FSREQ_READDIR, NULL)) <= 0)
+		return r;
+	memmove(buf, fsipcbuf.readdirRet.ret_buf, r);
+	return r;
+}
+
+// PROJECT: Map 'len' bytes of file 'fdnum' from 'offset' on read-only
+// at 'va', like mmap.  The pages are the file server's block cache
+// pages, so nothing is copied; they hold the file as it was when it
+// was mapped.  The server keeps the blocks for us until we unmap them.
+// The last page of the file is a copy, zeroed past the end of the file.
+// 'va' and 'offset' must be page-aligned.
+//
+// Returns the number of bytes of the file mapped, which is less than
+// 'len' at the end of the file, or < 0 on error.
+int
+mmap(void *va, size_t len, int fdnum, off_t offset)
+{
+	struct Fd *fd;
+	size_t done;
+	uint32_t npages;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if (PGOFF(va) || PGOFF(offset))
+		return -E_INVAL;
+	fsenv = fs_env();
+
+	for (done = 0; done < len; done += r) {
+		npages = MIN(ROUNDUP(len - done, PGSIZE) / PGSIZE, MAXIOPAGES);
+		if ((r = sys_page_grant(fsenv, va + done, npages)) < 0)
+			return r;
+		fsipcbuf.map.req_fileid = fd->fd_file.id;
+		fsipcbuf.map.req_offset = offset + done;
+		fsipcbuf.map.req_npages = npages;
+		fsipcbuf.map.req_va = (uintptr_t) va + done;
+		r = fsipc(FSREQ_MAP, NULL);
+		grant_restore();
+		if (r < 0)
+			return r;
+		if (r < npages * PGSIZE) {
+			done += r;
+			break;
+		}
+	}
+	return MIN(done, len);
+}
+
+// PROJECT: Unmap the pages of 'len' bytes at 'va' mapped with mmap.
+void
+munmap(void *va, size_t len)
+{
+	uintptr_t p;
+
+	for (p = ROUNDDOWN((uintptr_t) va, PGSIZE); p < (uintptr_t) va + len; p += PGSIZE)
+		sys_page_unmap(0, (void *) p);
+}
+
+// PROJECT: Like read, but point *blk at the data at 'offset' in the
+// file server's block cache instead of copying it.  The page is mapped
+// read-only at the fd's data page and stays valid until the next
+// read_map on this fd.  Returns the number of bytes from *blk on that
+// are in the file (at most to the end of the page), or < 0 on error.
+int
+read_map(int fdnum, off_t offset, void **blk)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if ((r = mmap(fd2data(fd), PGSIZE, fdnum, ROUNDDOWN(offset, PGSIZE))) < 0)
+		return r;
+	if (r <= PGOFF(offset))
+		return -E_EOF;
+	*blk = fd2data(fd) + PGOFF(offset);
+	return r - PGOFF(offset);
+}
+
+// PROJECT: Set up 'ring', a page of its own, as this environment's
+// submission/completion ring with the file server.  Read and write
+// entries must use buffers within the 'npages' pages at 'buf', which
+// are granted to the server from now on.
+int
+ring_setup(struct Fsring *ring, void *buf, size_t npages)
+{
+	int r;
+
+	if (PGOFF(ring) || PGOFF(buf))
+		return -E_INVAL;
+	fsenv = fs_env();
+
+	memset(ring, 0, sizeof(*ring));
+	ring_buf = buf;
+	ring_npages = npages;
+	grant_restore();
+
+	ipc_send(fsenv, FSREQ_RING_SETUP, ring, PTE_P | PTE_W | PTE_U);
+	if ((r = ipc_recv(NULL, NULL, NULL)) < 0) {
+		ring_buf = 0;
+		ring_npages = 0;
+		grant_restore();
+	}
+	return r;
+}
+
+// PROJECT: Fill the next submission entry of 'ring' for operation 'op'
+// on file 'fdnum'.  It is not seen by the server until ring_submit.
+// Returns -E_NO_MEM if the ring is full.
+int
+ring_prep(struct Fsring *ring, uint32_t op, int fdnum, void *buf, size_t n, uint32_t user)
+{
+	struct Fd *fd;
+	struct Fsring_sqe *sqe;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if (ring->sq_prep - ring->sq_head == NRINGENT)
+		return -E_NO_MEM;
+
+	sqe = &ring->sq[ring->sq_prep % NRINGENT];
+	sqe->sqe_op = op;
+	sqe->sqe_fileid = fd->fd_file.id;
+	sqe->sqe_n = n;
+	sqe->sqe_buf = (uintptr_t) buf;
+	sqe->sqe_user = user;
+	ring->sq_prep++;
+	return 0;
+}
+
+// PROJECT: Hand the prepared entries of 'ring' to the server with one
+// wakeup.  If the server is busy it finds them on its own when it is
+// done, so we never wait here.  Returns the number of entries submitted.
+int
+ring_submit(struct Fsring *ring)
+{
+	int n = ring->sq_prep - ring->sq_tail;
+
+	ring->sq_tail = ring->sq_prep;
+	if (n > 0)
+		sys_ipc_try_send(fsenv, FSREQ_RING_ENTER, ring, PTE_P | PTE_W | PTE_U);
+	return n;
+}
+
+// PROJECT: Wait for the next completion of 'ring' and copy it to *cqe.
+// Rather than polling the ring, ask the server to serve it and sleep
+// until it answers.
+void
+ring_wait(struct Fsring *ring, struct Fsring_cqe *cqe)
+{
+	while (ring->cq_head == ring->cq_tail) {
+		ipc_send(fsenv, FSREQ_RING_WAIT, ring, PTE_P | PTE_W | PTE_U);
+		ipc_recv(NULL, NULL, NULL);
+	}
+	*cqe = ring->cq[ring->cq_head % NRINGENT];
+	ring->cq_head++;
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
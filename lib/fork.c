@@ -162,10 +162,52 @@ fork(void)
 
 
 // Challenge!
-int
+// PROJECT: Like fork, but the child shares our memory: both see every
+// page mapped below UPRIVATE, now or later, by either of them.  The
+// stacks in [UPRIVATE, UTOP) are the child's own, copied from ours.
+// thisenv is shared too and keeps naming us, so the child must use
+// sys_getenvid to find itself.  Our page fault handler is shared, but
+// it runs on the child's own exception stack.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented yet\n");
-	return 0;
+	envid_t child_envid;
+	uintptr_t addr;
+	int r;
+
+	if((child_envid = sys_exofork()) < 0)
+		return child_envid;
+	if(child_envid == 0)
+		return 0;
+
+	sforked = 1;
+	if((r = sys_env_share_vm(child_envid)) < 0)
+		goto fail;
+
+	// Copy the stack.  UTEMP is shared, so we unmap it right away.
+	for(addr = UPRIVATE; addr < UXSTACKTOP - PGSIZE; addr += PGSIZE){
+
+		if(!(uvpd[PDX(addr)] & PTE_P) || !(uvpt[PGNUM(addr)] & PTE_P))
+			continue;
+
+		if((r = sys_page_alloc(child_envid, (void*)addr, PTE_P | PTE_U | PTE_W)) < 0
+		   || (r = sys_page_map(child_envid, (void*)addr, 0, UTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+			goto fail;
+		memmove(UTEMP, (void*)addr, PGSIZE);
+		sys_page_unmap(0, UTEMP);
+	}
+
+	if((r = sys_page_alloc(child_envid, (void*)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0
+	   || (r = sys_env_set_pgfault_upcall(child_envid, thisenv->env_pgfault_upcall)) < 0
+	   || (r = sys_env_set_status(child_envid, ENV_RUNNABLE)) < 0)
+		goto fail;
+
+	return child_envid;
+
+fail:
+	sys_env_destroy(child_envid);
+	return r;
 }
 
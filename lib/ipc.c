@@ -26,12 +26,18 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	envid_t sender_envid = 0;
 	int perm = 0;
 	int32_t retval = -E_INVAL;
+	const volatile struct Env *e = thisenv;
 
 	if(sys_ipc_recv((pg) ? pg : (void*)UTOP) == 0){
 
-		sender_envid = thisenv->env_ipc_from;
-		perm = thisenv->env_ipc_perm;
-		retval = thisenv->env_ipc_value;
+		// PROJECT: Envs made by sfork share thisenv, but each
+		// receives its own messages.
+		if(sforked)
+			e = &envs[ENVX(sys_getenvid())];
+
+		sender_envid = e->env_ipc_from;
+		perm = e->env_ipc_perm;
+		retval = e->env_ipc_value;
 	}
 
 	if(from_env_store)
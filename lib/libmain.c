@@ -6,6 +6,7 @@
 extern void umain(int argc, char **argv);
 
 const volatile struct Env *thisenv;
+bool sforked;	// PROJECT
 const char *binaryname = "<unknown>";
 
 void
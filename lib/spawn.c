@@ -292,6 +292,17 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 			// allocate a blank page
 			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
 				return r;
+		} else if (!(perm & PTE_W) && filesz - i >= PGSIZE
+			   && PGOFF(fileoffset) == 0) {
+			// PROJECT: text straight from the file server's block
+			// cache, so all instances of the program share it.
+			// Only whole pages of the segment; the block of the
+			// last, partial one goes on with other file bytes,
+			// so that page is copied below.
+			if ((r = read_map(fd, fileoffset + i, &blk)) < 0)
+				return r;
+			if ((r = sys_page_map(0, ROUNDDOWN(blk, PGSIZE), child, (void*) (va + i), perm)) < 0)
+				panic("spawn: sys_page_map text: %e", r);
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
@@ -117,3 +117,38 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+// PROJECT
+int
+sys_irq_listen(int irq)
+{
+	return syscall(SYS_irq_listen, 1, irq, 0, 0, 0, 0);
+}
+
+// PROJECT
+int
+sys_irq_wait(void)
+{
+	return syscall(SYS_irq_wait, 0, 0, 0, 0, 0, 0);
+}
+
+// PROJECT
+int
+sys_page_grant(envid_t envid, void *va, size_t npages)
+{
+	return syscall(SYS_page_grant, 1, envid, (uint32_t) va, npages, 0, 0);
+}
+
+// PROJECT
+int
+sys_env_share_vm(envid_t envid)
+{
+	return syscall(SYS_env_share_vm, 1, envid, 0, 0, 0, 0);
+}
+
+// PROJECT: Returns the PTE_A and PTE_D bits the page had, so no check.
+int
+sys_page_clear(void *va, int bits)
+{
+	return syscall(SYS_page_clear, 0, (uint32_t) va, bits, 0, 0, 0);
+}
+
@@ -1,6 +1,5 @@
 #include <inc/lib.h>
 
-char* PATH = (char*)PATH_VA;
 char buf[2048];
 
 void
@@ -20,7 +19,6 @@ void
 umain(int argc, char **argv)
 {
 	int fd, i;
-	char path[MAXPATHLEN];
 
 	binaryname = "cat";
 
@@ -31,20 +29,12 @@ umain(int argc, char **argv)
 
 	for (i = 1; i < argc; i++) {
 
-		if(argv[i][0] == '/')
-			strcpy(path, argv[i]);
-		else{
-			strcpy(path, PATH);
-			if(strlen(path) > 1)
-				strcat(path, "/");
-			strcat(path, argv[i]);
+		// PROJECT: relative paths start at the working directory
+		if((fd = openat(CWD_FD, argv[i], O_RDONLY)) < 0){
+			printf("can't open %s: %e\n", argv[i], fd);
+			return;
 		}
-
-		if((fd = open(path, O_RDONLY)) < 0){
-			printf("can't open %s: %e\n", path, fd);
-			return;			
-		}
-		cat(fd, path);
+		cat(fd, argv[i]);
 		close(fd);
 	}
 }
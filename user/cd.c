@@ -80,7 +80,6 @@ chdir_end:
 void
 cd(char* arg_path)
 {
-	struct Stat st;
 	char new_path[MAXPATHLEN];
 	int r;
 
@@ -88,7 +87,8 @@ cd(char* arg_path)
 	char PATH_BACKUP[MAXPATHLEN];
 	strcpy(PATH_BACKUP, PATH);
 
-	if((r = chdir(arg_path)) == -E_BAD_PATH || (r = stat(PATH, &st)) < 0 || !(st.st_ftype & FTYPE_DIR)){
+	// PROJECT: fchdir fails unless PATH is a directory
+	if((r = chdir(arg_path)) == -E_BAD_PATH || (r = fchdir(CWD_FD, PATH)) < 0){
 
 		strcpy(PATH, PATH_BACKUP);
 		cprintf("cd: %s: No such file or directory\n", arg_path);
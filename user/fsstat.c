@@ -0,0 +1,104 @@
+#include <inc/lib.h>
+
+// PROJECT: A new command: fsstat [-l] [-r]
+// Prints the file server's block cache, disk and request counters.
+// With -l it also prints the latency histogram of each request type,
+// in cycles.  With -r the counters are cleared after they are printed.
+
+const char *reqname[NFSREQ] = {
+	[FSREQ_OPEN] =		"open",
+	[FSREQ_SET_SIZE] =	"set_size",
+	[FSREQ_READ] =		"read",
+	[FSREQ_WRITE] =		"write",
+	[FSREQ_STAT] =		"stat",
+	[FSREQ_FLUSH] =		"flush",
+	[FSREQ_REMOVE] =	"remove",
+	[FSREQ_SYNC] =		"sync",
+	[FSREQ_PRUNE] =		"prune",
+	[FSREQ_STATS] =		"stats",
+	[FSREQ_READ_DIRECT] =	"read_direct",
+	[FSREQ_WRITE_DIRECT] =	"write_direct",
+	[FSREQ_MAP] =		"map",
+	[FSREQ_RING_SETUP] =	"ring_setup",
+	[FSREQ_RING_ENTER] =	"ring_enter",
+	[FSREQ_READDIR] =	"readdir",
+	[FSREQ_STAT_PATH] =	"stat_path",
+	[FSREQ_LIST_VERSIONS] =	"list_versions",
+	[FSREQ_CHDIR] =		"chdir",
+	[FSREQ_CLOSE] =		"close",
+	[FSREQ_RING_WAIT] =	"ring_wait",
+};
+
+void
+usage(void)
+{
+	printf("usage: fsstat [-l] [-r]\n");
+	exit();
+}
+
+// Print the latency histogram of request type 'req', one line per
+// non-empty power-of-two bucket.
+void
+print_latency(struct Fsstats *st, int req)
+{
+	int i;
+
+	printf("  %s: %d requests, mean %d cycles\n", reqname[req] ? reqname[req] : "?",
+	       st->st_reqs[req], (int)(st->st_cycles[req] / st->st_reqs[req]));
+	for (i = 0; i < NLATBUCKETS; i++)
+		if (st->st_lat[req][i])
+			printf("    >= 2^%-2d  %d\n", i, st->st_lat[req][i]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	bool reset = 0, latency = 0;
+	struct Fsstats st;
+	struct Argstate args;
+
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'l':
+			latency = 1;
+			break;
+		case 'r':
+			reset = 1;
+			break;
+		default:
+			usage();
+		}
+	if (argc != 1)
+		usage();
+
+	if ((r = fsstats(&st, reset)) < 0) {
+		printf("fsstat: %e\n", r);
+		return;
+	}
+
+	printf("block cache:\n");
+	printf("  lookups    %d (%d%% hits)\n", st.st_lookups,
+	       st.st_lookups ? (int)((uint64_t)st.st_hits * 100 / st.st_lookups) : 0);
+	printf("  faults     %d (+%d blocks read ahead)\n", st.st_faults, st.st_readahead);
+	printf("  evictions  %d\n", st.st_evictions);
+	printf("  flushes    %d\n", st.st_flushes);
+	printf("dentry cache:\n");
+	printf("  lookups    %d (%d%% hits)\n", st.st_dlookups,
+	       st.st_dlookups ? (int)((uint64_t)st.st_dhits * 100 / st.st_dlookups) : 0);
+	printf("disk:\n");
+	printf("  reads      %d (%d sectors)\n", st.st_rcmds, st.st_rsects);
+	printf("  writes     %d (%d sectors)\n", st.st_wcmds, st.st_wsects);
+	printf("requests:\n");
+	for (i = 0; i < NFSREQ; i++)
+		if (st.st_reqs[i])
+			printf("  %-10s %d\n", reqname[i] ? reqname[i] : "?", st.st_reqs[i]);
+
+	if (latency) {
+		printf("latency:\n");
+		for (i = 0; i < NFSREQ; i++)
+			if (st.st_reqs[i])
+				print_latency(&st, i);
+	}
+}
@@ -1,52 +1,51 @@
 #include <inc/lib.h>
 
-char* PATH = (char*)PATH_VA;
 bool all_flag, long_flag;
 
+char dirbuf[PGSIZE] __attribute__((aligned(PGSIZE)));
+
 void
 ls_short(const char* path)
 {
 	int r, fd, n, ctr = 0;
-	struct File f;
+	struct Fsdirent *d;
 	struct Stat st;
 	char fname[MAXNAMELEN+1];
 
-	if((r = stat(path, &st)) < 0)
+	if ((fd = openat(CWD_FD, path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+
+	if((r = fstat(fd, &st)) < 0)
 		panic("stat %s: %e", path, r);
 
 	if(st.st_ftype & FTYPE_REG){
 		printf("%s\n", st.st_name);
+		close(fd);
 		return;
 	}
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		panic("open %s: %e", path, fd);
+	while ((n = readdir(fd, dirbuf)) > 0){
+		for (d = (struct Fsdirent *) dirbuf; (char *) d < dirbuf + n;
+		     d = (struct Fsdirent *) ((char *) d + d->d_reclen)){
 
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f){
+			if(++ctr == 5){
+				cputchar('\n');
+				ctr = 1;
+			}
 
-		if(!f.f_name[0])
-			continue;
-		
-		if(++ctr == 5){
-			cputchar('\n');
-			ctr = 1;
-		}
+			strcpy(fname, d->d_name);
 
-		strcpy(fname, f.f_name);
+			if(d->d_type & FTYPE_DIR)
+				strcat(fname, "/");
 
-		if(f.f_type & FTYPE_DIR)
-			strcat(fname, "/");
-			
-		printf("%-20s", fname);
+			printf("%-20s", fname);
+		}
 	}
 	close(fd);
 
 	if(ctr > 0)
 		cputchar('\n');
 
-	if (n > 0)
-		panic("short read in directory %s", path);
-
 	if (n < 0)
 		panic("error reading directory %s: %e", path, n);
 }
@@ -55,12 +54,14 @@ void
 ls_long(const char* path)
 {
 	int r, fd, n;
-	struct File f;
+	struct Fsdirent *d;
 	struct Stat st;
 	char fname[MAXNAMELEN+1];
-	char ffpath[MAXPATHLEN];
 
-	if((r = stat(path, &st)) < 0)
+	if ((fd = openat(CWD_FD, path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+
+	if((r = fstat(fd, &st)) < 0)
 		panic("stat %s: %e", path, r);
 
 	if(st.st_ftype & FTYPE_REG){
@@ -70,49 +71,34 @@ ls_long(const char* path)
 
 		printf("%-8s %-7dB   %-20s\n", "file", st.st_size, st.st_name);
 
+		close(fd);
 		return;
 	}
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		panic("open %s: %e", path, fd);
-
 	if(all_flag){
 		printf("%-6d  %-8s %-7dB   %-20s\n", st.st_ts, "dir", st.st_size, ".");
 		printf("%-6d  %-8s %-7dB   %-20s\n", 0, "dir", 0, "..");
 	}
 
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f){
-
-		if(!f.f_name[0])
-			continue;
-
-		strcpy(fname, f.f_name);
+	// PROJECT: One FSREQ_READDIR round trip returns a page of entries
+	// along with their latest versions, so there is no stat per entry.
+	while ((n = readdir(fd, dirbuf)) > 0){
+		for (d = (struct Fsdirent *) dirbuf; (char *) d < dirbuf + n;
+		     d = (struct Fsdirent *) ((char *) d + d->d_reclen)){
 
-		if(f.f_type & FTYPE_DIR)
-			strcat(fname, "/");
+			strcpy(fname, d->d_name);
 
-		if(f.f_type & FTYPE_FF){
+			if(d->d_type & FTYPE_DIR)
+				strcat(fname, "/");
 
-			if(all_flag)
-				printf("%-6d  %-8s %-7dB   %-20s\n", f.f_timestamp, "fatfile", f.f_size, f.f_name);
+			if(all_flag && (d->d_type & FTYPE_FF))
+				printf("%-6d  %-8s %-7dB   %-20s\n", d->d_ffts, "fatfile", d->d_ffsize, d->d_name);
 
-			strcpy(ffpath, path);
-			strcat(ffpath, "/");
-			strcat(ffpath, f.f_name);
-			
-			if((r = stat(ffpath, &st)) < 0)
-				panic("stat %s: %e", ffpath, r);
-
-			printf("%-6d  %-8s %-7dB   %-20s\n", st.st_ts, (f.f_type & FTYPE_DIR) ? "dir" : "file", st.st_size, fname);
+			printf("%-6d  %-8s %-7dB   %-20s\n", d->d_ts, (d->d_type & FTYPE_DIR) ? "dir" : "file", d->d_size, fname);
 		}
-		else
-			printf("%-6d  %-8s %-7dB   %-20s\n", st.st_ts, (f.f_type & FTYPE_DIR) ? "dir" : "file", f.f_size, fname);
 	}
 	close(fd);
 
-	if (n > 0)
-		panic("short read in directory %s", path);
-
 	if (n < 0)
 		panic("error reading directory %s: %e", path, n);
 }
@@ -129,7 +115,7 @@ umain(int argc, char **argv)
 {
 	int i;
 	struct Argstate args;
-	char ls_path[MAXPATHLEN];
+	const char *ls_path;
 
 	argstart(&argc, argv, &args);
 
@@ -146,19 +132,9 @@ umain(int argc, char **argv)
 		}
 	}
 
-	if(argc > 1 && argv[1][0] == '/')
-		
-		strcpy(ls_path, argv[1]);
-
-	else{
-		strcpy(ls_path, PATH);
-
-		if(argc > 1){
-			if(strlen(ls_path) > 1)
-				strcat(ls_path, "/");
-			strcat(ls_path, argv[1]);
-		}
-	}
+	// PROJECT: relative paths, and no path at all, start at the
+	// working directory
+	ls_path = (argc > 1) ? argv[1] : "";
 
 	if(long_flag || all_flag)
 		ls_long(ls_path);
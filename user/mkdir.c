@@ -1,6 +1,5 @@
 #include <inc/lib.h>
 
-char* PATH = (char*)PATH_VA;
 
 void
 mkdir(char* path)
@@ -8,7 +7,8 @@ mkdir(char* path)
 	int fd;
 	struct Stat st;
 
-	if((fd = open(path, O_CREAT | O_MKDIR)) < 0){
+	// PROJECT: relative paths start at the working directory
+	if((fd = openat(CWD_FD, path, O_CREAT | O_MKDIR)) < 0){
 		printf("can't open %s: %e\n", path, fd);
 		return;
 	}
@@ -25,20 +25,9 @@ usage(void)
 void
 umain(int argc, char** argv)
 {
-	char path[MAXPATHLEN];
-
 	if(argc != 2)
 		usage();
 
-	if(argv[1][0] == '/')
-		strcpy(path, argv[1]);
-	else{
-		strcpy(path, PATH);
-		if(strlen(path) > 1)
-			strcat(path, "/");
-		strcat(path, argv[1]);
-	}
-
-	mkdir(path);
+	mkdir(argv[1]);
 }
 
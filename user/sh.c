@@ -26,7 +26,6 @@ runcmd(char* s)
 {
 	char *argv[MAXARGS], *t, argv0buf[BUFSIZ];
 	int argc, c, i, r, p[2], fd, pipe_child;
-	char path[MAXPATHLEN];	// PROJECT
 
 	pipe_child = 0;
 	gettoken(s, 0);
@@ -59,7 +58,7 @@ again:
 			// then close the original 'fd'.
 
 			// LAB 5: Your code here.
-			if((fd = open(t, O_RDONLY)) < 0){
+			if((fd = openat(CWD_FD, t, O_RDONLY)) < 0){	// PROJECT
 
 				cprintf("open %s for read: %e", t, fd);
 				exit();
@@ -78,18 +77,9 @@ again:
 					cprintf("PROJECT: syntax error: >> not followed by word\n");
 					exit();
 				}
-				if(t[0] == '/')
-					// user pass absolute path
-					strcpy(path, t);
-				else{
-					// user pass relative path
-					strcpy(path, PATH);
-					if(strlen(path) > 1)
-						strcat(path, "/");
-					strcat(path, t);
-				}
-				if((fd = open(path, O_WRONLY | O_APPEND)) < 0){
-					cprintf("PROJECT: open %s for write: %e", path, fd);
+				// relative paths start at the working directory
+				if((fd = openat(CWD_FD, t, O_WRONLY | O_APPEND)) < 0){
+					cprintf("PROJECT: open %s for write: %e", t, fd);
 					exit();
 				}
 			}
@@ -98,18 +88,9 @@ again:
 					cprintf("syntax error: > not followed by word\n");
 					exit();
 				}
-				if(t[0] == '/')		// PROJECT
-					// user pass absolute path
-					strcpy(path, t);
-				else{
-					// user pass relative path
-					strcpy(path, PATH);
-					if(strlen(path) > 1)
-						strcat(path, "/");
-					strcat(path, t);
-				}
-				if ((fd = open(path, O_WRONLY | O_TRUNC)) < 0) {
-					cprintf("open %s for write: %e", path, fd);
+				// PROJECT: relative paths start at the working directory
+				if ((fd = openat(CWD_FD, t, O_WRONLY | O_TRUNC)) < 0) {
+					cprintf("open %s for write: %e", t, fd);
 					exit();
 				}
 			}
@@ -341,6 +322,14 @@ umain(int argc, char **argv)
 	// init PATH to root
 	strcpy(PATH, "/");	// PROJECT
 
+	// PROJECT: and the working directory handle, which cd repoints
+	if((r = open("/", O_RDONLY)) < 0)
+		panic("open /: %e", r);
+	if(r != CWD_FD){
+		dup(r, CWD_FD);
+		close(r);
+	}
+
 	while (1) {
 		char *buf;
 
@@ -1,6 +1,5 @@
 #include <inc/lib.h>
 
-char* PATH = (char*)PATH_VA;
 
 // PROJECT: A new command: touch [path]
 // will set the timestamp to the current value of global_timestamp
@@ -10,28 +9,16 @@ void
 touch(int argc, char** argv){
 
 	int i, fd;
-	char file_path[MAXPATHLEN];
 
 	if(argc == 1)
 		return;
 
 	for(i = 1; i < argc; ++i){
 
-		if(argv[i][0] == '/')
+		// relative paths start at the working directory
+		if((fd = openat(CWD_FD, argv[i], O_CREAT)) < 0){
 
-			strcpy(file_path, argv[i]);
-		else{
-			strcpy(file_path, PATH);
-
-			if(strlen(file_path) > 1)
-				strcat(file_path, "/");
-
-			strcat(file_path, argv[i]);
-		}
-
-		if((fd = open(file_path, O_CREAT)) < 0){
-
-			printf("can't open %s: %e\n", file_path, fd);
+			printf("can't open %s: %e\n", argv[i], fd);
 			return;
 		}
 
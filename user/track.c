@@ -1,33 +1,46 @@
 #include <inc/lib.h>
 
-char* PATH = (char*)PATH_VA;
-
 // PROJECT: A new command: track [-t] file
 // Will restore the file from timestamp -t (by creating a new timestamp)
 // If -t not specify, will show the all timestamp of the file
+//
+// track --prune [-n last] [-s ts] [-l] file
+// Will remove the versions of the file that none of the rules keep:
+// the 'last' latest versions, versions from timestamp 'ts' on (negative
+// is relative to the last timestamp) and, with -l, the latest version
+// of each power-of-two age range.
+// With -d instead of a file, the rules become the policy the file
+// server prunes new versions with in the background.
+// Relative paths start at the shell's directory, CWD_FD.
+
+struct Fsversion vers[NVERSIONS];
 
 void
 track(char* path, ts_t req_ts)
 {
-	int fd, i, num_blk;
-	struct Stat st;
+	int fd, i, j, n, num_blk;
+	char name[MAXNAMELEN];
 
 	if(req_ts == TS_UNSPECIFIED){
 
-		for(; req_ts >= 0 && stat_ts(path, &st, req_ts) == 0; req_ts = st.st_ts - 1){
+		// Each request returns a batch of versions older than the last one seen.
+		while(req_ts >= 0 && (n = list_versions(CWD_FD, path, req_ts, name, vers)) > 0){
+
+			for(j = 0; j < n; ++j){
+				printf("%-6d %-7dB   %-20s\tblk_num: [", vers[j].v_ts, vers[j].v_size, name);
 
-			printf("%-6d %-7dB   %-20s\tblk_num: [", st.st_ts, st.st_size, st.st_name);
-			
-			num_blk = (st.st_size + BLKSIZE - 1) / BLKSIZE;
-			for(i = 0; i < MIN(num_blk, NDIRECT); ++i){
-				printf(" %d ", st.st_blkn[i]);
- 			}
-			printf("]\n");
+				num_blk = (vers[j].v_size + BLKSIZE - 1) / BLKSIZE;
+				for(i = 0; i < MIN(num_blk, NDIRECT); ++i){
+					printf(" %d ", vers[j].v_blkn[i]);
+				}
+				printf("]\n");
+			}
+			req_ts = vers[n - 1].v_ts - 1;
 		}
 		return;
 	}
 
-	if((fd = open_ts(path, O_CREAT | O_WRONLY, req_ts)) < 0){
+	if((fd = openat_ts(CWD_FD, path, O_CREAT | O_WRONLY, req_ts)) < 0){
 		printf("can't open %s: %e\n", path, fd);
 		return;
 	}
@@ -39,17 +52,70 @@ void
 usage(void)
 {
 	printf("usage: track [-t] <file>\n");
+	printf("       track --prune [-n last] [-s ts] [-l] {-d | <file>}\n");
 	exit();
 }
 
+void
+track_prune(int argc, char** argv)
+{
+	int i, r;
+	struct Argstate args;
+	struct Retention rp;
+	bool set_default = 0;
+
+	memset(&rp, 0, sizeof(rp));
+
+	argstart(&argc, argv, &args);
+	while((i = argnext(&args)) >= 0){
+		switch(i){
+		case 'n':
+			rp.r_keep_last = strtol(argvalue(&args), 0, 0);
+			break;
+		case 's':
+			rp.r_keep_since = (ts_t)strtol(argvalue(&args), 0, 0);
+			break;
+		case 'l':
+			rp.r_thin = 1;
+			break;
+		case 'd':
+			set_default = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if(set_default){
+		if(argc != 1)
+			usage();
+		if((r = set_retention(&rp)) < 0)
+			printf("can't set retention: %e\n", r);
+		return;
+	}
+
+	if(argc != 2)
+		usage();
+
+	if((r = prune(CWD_FD, argv[1], &rp)) < 0)
+		printf("can't prune %s: %e\n", argv[1], r);
+	else
+		printf("%d versions removed\n", r);
+}
+
 void
 umain(int argc, char** argv)
 {
 	int i;
 	struct Argstate args;
-	char path[MAXPATHLEN];
 	ts_t req_ts = TS_UNSPECIFIED;
 
+	if(argc > 1 && strcmp(argv[1], "--prune") == 0){
+		argv[1] = argv[0];
+		track_prune(argc - 1, argv + 1);
+		return;
+	}
+
 	argstart(&argc, argv, &args);
 	while((i = argnext(&args)) >= 0){
 		switch(i){
@@ -63,15 +129,6 @@ umain(int argc, char** argv)
 	if(argc != 2)
 		usage();
 
-	if(argv[1][0] == '/')
-		strcpy(path, argv[1]);
-	else{
-		strcpy(path, PATH);
-		if(strlen(path) > 1)
-			strcat(path, "/");
-		strcat(path, argv[1]);
-	}
-
-	track(path, req_ts);
+	track(argv[1], req_ts);
 }
 